@@ -29,13 +29,39 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include <SDL_video.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#endif
+
 typedef uint32_t u32;
 typedef uint8_t bool;
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef int16_t i16;
+typedef uint64_t u64;
 
 #define true 1
 #define false 0
@@ -57,6 +83,125 @@ int intmin(int a, int b)
     return (a < b) ? a : b;
 }
 
+float floatmax(float a, float b)
+{
+    return (a < b) ? b : a;
+}
+
+float floatmin(float a, float b)
+{
+    return (a < b) ? a : b;
+}
+
+/**
+ *  \brief xorshift32: next pseudo-random number from *state.
+ *
+ *  Unlike rand(), every thread can have its own state. state must
+ *  not be 0.
+ */
+inline internal u32 XorShift32(u32 *state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/**
+ *  \brief 32 random bits, each set with probability
+ *  threshold / 2^BERNOULLI_BITS.
+ *
+ *  Takes BERNOULLI_BITS random words, one per bit of threshold from
+ *  the lowest up: a 1 ORs the next word in (p becomes (1 + p)/2), a
+ *  0 ANDs it in (p becomes p/2). So 32 rare decisions cost
+ *  BERNOULLI_BITS draws instead of 32.
+ */
+#define BERNOULLI_BITS 10
+inline internal u32 BernoulliWord(u32 threshold, u32 *state)
+{
+    u32 bits = 0;
+    for (int b=0; b < BERNOULLI_BITS; b++)
+    {
+        u32 word = XorShift32(state);
+        bits = ((threshold >> b) & 1) ? (bits | word) : (bits & word);
+    }
+    return bits;
+}
+
+inline internal bool MaskBit(const u32 *mask, int i)
+{
+    return (mask[i >> 5] >> (i & 31)) & 1;
+}
+
+/**
+ *  \brief round(x/255) for x in [0, 255*255]
+ */
+inline internal u32 div255(u32 x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/**
+ *  \brief Alpha blend one ARGB8888 pixel over another (scalar).
+ *
+ *  Same math as SDL_BLENDMODE_BLEND (see CPU compositor).
+ */
+inline internal u32 BlendPixel(u32 src, u32 dst)
+{
+    u32 a = src >> 24;
+    u32 ia = 255 - a;
+    src |= 0xFF000000; // alpha channel blends 255 with dstA
+    u32 out = 0;
+    for (int shift=0; shift < 32; shift += 8)
+    {
+        u32 s = (src >> shift) & 0xFF;
+        u32 d = (dst >> shift) & 0xFF;
+        out |= div255(s*a + d*ia) << shift;
+    }
+    return out;
+}
+
+#ifdef __SSE2__
+/**
+ *  \brief Alpha blend four ARGB8888 pixels over four others.
+ *
+ *  Works on two pixels at a time as eight 16-bit channels.
+ *  s*a + d*(255-a) + 128 is at most 65153, so it fits in u16.
+ */
+inline internal __m128i BlendPixels4(__m128i src, __m128i dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+
+    __m128i s_lo = _mm_unpacklo_epi8(src, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(src, zero);
+    // Broadcast each pixel's alpha (16-bit lane 3 and 7) across its channels.
+    __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xFF), 0xFF);
+    __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xFF), 0xFF);
+    // Alpha channel blends 255 with dstA.
+    src = _mm_or_si128(src, alpha_mask);
+    s_lo = _mm_unpacklo_epi8(src, zero);
+    s_hi = _mm_unpackhi_epi8(src, zero);
+    __m128i d_lo = _mm_unpacklo_epi8(dst, zero);
+    __m128i d_hi = _mm_unpackhi_epi8(dst, zero);
+
+    __m128i t_lo = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo), _mm_mullo_epi16(d_lo, _mm_sub_epi16(c255, a_lo))),
+            c128);
+    __m128i t_hi = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi), _mm_mullo_epi16(d_hi, _mm_sub_epi16(c255, a_hi))),
+            c128);
+    // (t + (t >> 8)) >> 8
+    t_lo = _mm_srli_epi16(_mm_add_epi16(t_lo, _mm_srli_epi16(t_lo, 8)), 8);
+    t_hi = _mm_srli_epi16(_mm_add_epi16(t_hi, _mm_srli_epi16(t_hi, 8)), 8);
+    return _mm_packus_epi16(t_lo, t_hi);
+}
+#endif
+
 
 // ---------------
 // | Logging lib |
@@ -71,9 +216,11 @@ internal void clear_log_file(void)
 
 internal void log_to_file(const char * log_msg)
 {
-    f = fopen("log.txt", "a");
-    fprintf(f, "%s", log_msg);
-    fclose(f);
+    // Own FILE * so other threads (capture writer) can log too.
+    FILE *log_file = fopen("log.txt", "a");
+    if (!log_file) return;
+    fprintf(log_file, "%s", log_msg);
+    fclose(log_file);
 }
 
 #define MAX_LOG_MSG 1024
@@ -161,513 +308,5055 @@ internal void log_renderer_info(SDL_Renderer * renderer)
 }
 
 
-// ---------------
-// | Drawing lib |
-// ---------------
-
-#define SCREEN_WIDTH 200
-#define SCREEN_HEIGHT 150
-/* #define SCREEN_WIDTH 1280 */
-/* #define SCREEN_HEIGHT 760 */
-#define PIXEL_SCALE 4
-/* #define PIXEL_SCALE 1 */
-#define SCALED_SCREEN_WIDTH  (PIXEL_SCALE*SCREEN_WIDTH)
-#define SCALED_SCREEN_HEIGHT (PIXEL_SCALE*SCREEN_HEIGHT)
+// --------------
+// | Memory lib |
+// --------------
 
-// ------------
-// | Momentum |
-// ------------
+/** One allocation for all the grids
+ *
+ * Grids come out of one block. Each grid starts on a cache line, so
+ * SIMD loads of a row start can be aligned, and is followed by one
+ * spare cache line. World sizes are often powers of two; without the
+ * spare line the same cell of grids that sit back to back lands in
+ * the same cache set.
+ *
+ * Before ArenaInit, an arena has no memory and ArenaGrid only counts
+ * bytes. So: hand out the grids once to measure, ArenaInit, then
+ * hand them out again for real. On Linux, an arena of a few huge
+ * pages or more asks for transparent huge pages: big worlds take
+ * fewer TLB misses.
+ */
+#define ARENA_ALIGN 64               // bytes in a cache line
+#define ARENA_HUGE_PAGE (2u << 20)   // x86-64 transparent huge page
 
 typedef struct
 {
-    i16 dx; // vertical (think rows)
-    i16 dy; // horizontal (think cols)
-} momentum_t;
-
+    u8 *base;         // NULL while measuring
+    size_t size;      // bytes at base
+    size_t used;      // bytes handed out (or measured) so far
+    size_t payload;   // bytes the grids asked for, without padding
+    int ngrids;
+    void *raw;        // what to give back to the OS
+    size_t raw_size;
+    bool mapped;      // raw is from mmap, not calloc
+    bool huge_pages;
+} arena_t;
 
-/** Types of artwork
+/**
+ *  \brief Hand out a zeroed grid of count elements.
  *
- * Green cursor is a rect_t.
- * Everything else is drawn pixel-by-pixel Noita style.
- * Colors are ARGBA: 0xAARRGGBB.
- * x,y conventions:
- *  Cursor artwork: x is COL, y is ROW
- *  Pixel artwork:  x is ROW, y is COL
+ *  \return A 64-byte aligned grid, or NULL while measuring.
  */
-
-// ------------------
-// | Background art |
-// ------------------
-
-#define NOTHING_COLOR       0x00000000
-#define OUT_OF_BOUNDS_COLOR 0x00000001
-#define BGND_COLOR       0x40221100
-/* #define NO_FLICKER       0x01010101 */
-/* #define BGND_FLICKER    (0x80552233 - BGND_COLOR) */
-#define BGND_FLICKER    (0x80000000 - (BGND_COLOR&0xFF000000) + (BGND_COLOR&0x00FFFFFF) + 0x00020202)
-
-// --------------
-// | Cursor art |
-// --------------
-
-typedef struct
+internal void *ArenaGrid(arena_t *arena, size_t count, size_t elem_size)
 {
-    int x;
-    int y;
-    int w;
-    int h;
-} rect_t;
+    size_t bytes = count * elem_size;
+    size_t padded = ((bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1)) + ARENA_ALIGN;
+    void *grid = NULL;
+    if (arena->base)
+    {
+        assert(arena->used + padded <= arena->size);
+        grid = arena->base + arena->used;
+    }
+    arena->used += padded;
+    arena->payload += bytes;
+    arena->ngrids++;
+    return grid;
+}
 
-internal void FillRect(rect_t rect, u32 pixel_color, u32 *screen_pixels_prev)
+/**
+ *  \brief Allocate the bytes measured so far and start handing out again.
+ *
+ *  \return false if there is no memory.
+ */
+internal bool ArenaInit(arena_t *arena)
 {
-    assert(screen_pixels_prev);
-    for (int row=0; row < rect.h; row++)
+    size_t size = arena->used;
+    assert(!arena->base && (size > 0));
+    arena->used = 0;
+    arena->payload = 0;
+    arena->ngrids = 0;
+    arena->mapped = false;
+    arena->huge_pages = false;
+#ifdef __linux__
+    if (size >= 4*ARENA_HUGE_PAGE)
     {
-        for (int col=0; col < rect.w; col++)
+        // Round up to whole huge pages and map one extra to align to one.
+        size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+        arena->raw_size = size + ARENA_HUGE_PAGE;
+        arena->raw = mmap(NULL, arena->raw_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena->raw == MAP_FAILED)
         {
-            screen_pixels_prev[ (row + rect.y)*SCREEN_WIDTH + (col + rect.x) ] = pixel_color;
+            arena->raw = NULL;
+            return false;
         }
+        uintptr_t start = ((uintptr_t)arena->raw + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1);
+        arena->base = (u8*)start;
+        arena->size = size;
+        arena->mapped = true;
+        // Only a hint: without THP the arena is still fine.
+        arena->huge_pages = (madvise(arena->base, size, MADV_HUGEPAGE) == 0);
+        return true;
     }
+#endif
+    arena->raw_size = size + ARENA_ALIGN;
+    arena->raw = calloc(arena->raw_size, 1);
+    if (!arena->raw) return false;
+    uintptr_t start = ((uintptr_t)arena->raw + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+    arena->base = (u8*)start;
+    arena->size = size;
+    return true;
 }
 
-// -------------
-// | Pixel art |
-// -------------
-
-// Each pixel is a particle.
-
-// Number of particles to simulate
-#define NP 2000 // program aborts if NP > (SCREEN_WIDTH * SCREEN_HEIGHT)
-
-// NTYPES: Number of particle types
-#define NTYPES 4
-#define ALL_TYPES NTYPES
-
-enum particle_type
+internal void ArenaLog(const arena_t *arena, const char *name)
 {
-    SAND,
-    SLIME,
-    WATER,
-    BRICK
-};
+    sprintf(log_msg, "%s arena: %lu bytes for %d grids (%lu requested, %lu reserved)%s\n",
+            name,
+            (unsigned long)arena->used, arena->ngrids,
+            (unsigned long)arena->payload, (unsigned long)arena->raw_size,
+            arena->huge_pages ? ", huge pages" : "");
+    log_to_file(log_msg);
+}
 
-// RGBA is not available!
-/* #define SAND_COLOR  0xFFBB0010 */
-/* #define WATER_COLOR 0x0088FF10 */
-/* #define SLIME_COLOR 0xFF88FF10 */
-/* #define BRICK_COLOR 0xFF000010 */
+internal void ArenaFree(arena_t *arena)
+{
+#ifdef __linux__
+    if (arena->mapped) munmap(arena->raw, arena->raw_size);
+    else free(arena->raw);
+#else
+    free(arena->raw);
+#endif
+    memset(arena, 0, sizeof(*arena));
+}
 
-// ARGB8888
-#define SAND_COLOR  0xFFFFBB00
-#define WATER_COLOR 0xC00088FF
-#define SLIME_COLOR 0xD0FF88FF
-#define BRICK_COLOR 0xFFFF0000
 
-static const u32 colors[NTYPES] = {
-    SAND_COLOR,
-    WATER_COLOR,
-    SLIME_COLOR,
-    BRICK_COLOR
-};
+// -------------
+// | Trace lib |
+// -------------
 
-/** How pixel coordinates work
+/** Chrome trace-event recorder
  *
- * x is row number (vertical), with 0 at top of screen
- * y is col number, with 0 at left of screen
+ * Press `t` to record the next TRACE_FRAMES frames. Events go
+ * into a preallocated array while recording. Nothing touches the
+ * disk until the recording is done, then everything is dumped to
+ * trace.json. Open trace.json in chrome://tracing or
+ * https://ui.perfetto.dev to see the timeline.
  *
- *  index of pixel at row x, col 0 is:
- *       row number * screen width
- *  then hop to pixel in column y:
- *       + y
+ * Usage:
+ *      u64 t0 = TraceBegin();
+ *      DoTheThing();
+ *      TraceEnd("DoTheThing", "sim", t0, -1);
+ *
+ * When not recording, TraceBegin and TraceEnd are a single branch
+ * on trace_on. Any thread may record events: the event slot is
+ * claimed with an atomic add. trace_on is atomic too: the main
+ * thread starts and stops recording while the capture writer may be
+ * in the middle of a TraceBegin.
  */
 
+#define TRACE_MAX_EVENTS (1<<16)
+#define TRACE_FRAMES 300
+#define TRACE_MAX_THREADS 16
+
+typedef struct
+{
+    const char *name; // must outlive the recording, e.g., a string literal
+    const char *cat;  // category, e.g., "frame", "sim", "render"
+    u64 begin;        // SDL_GetPerformanceCounter ticks
+    u64 end;
+    u32 tid;          // thread the event happened on
+    int arg;          // e.g., chunk row number, or -1 for no arg
+} trace_event_t;
+
+typedef struct
+{
+    u32 tid;
+    const char *name;
+} trace_thread_t;
+
+internal SDL_atomic_t trace_on; // 0 or 1
+internal int trace_frames_left;
+internal u64 trace_start;
+internal SDL_atomic_t trace_nevents;
+internal trace_event_t trace_events[TRACE_MAX_EVENTS];
+internal trace_thread_t trace_threads[TRACE_MAX_THREADS];
+internal SDL_atomic_t trace_nthreads;
+
 /**
- *  \brief Set momentum in PREV buffer.
+ *  \brief Label the calling thread in the trace viewer.
  *
- *  \param x    Screen row number (0 is top)
- *  \param y    Screen col number (0 is left)
- *  \param momentum Momentum to set at this pixel
- *  \param momentum_buffer Pointer to the momentum buffer to write to
+ *  \param name Thread name, e.g., "main" (must be a string literal)
  */
-inline internal void MomentumSetUnsafe(int x, int y, momentum_t momentum, momentum_t * momentum_buffer)
+internal void TraceNameThread(const char *name)
 {
-    momentum_buffer[x*SCREEN_WIDTH+y] = momentum;
+    int i = SDL_AtomicAdd(&trace_nthreads, 1);
+    if (i < TRACE_MAX_THREADS)
+    {
+        trace_threads[i].tid = (u32)SDL_ThreadID();
+        trace_threads[i].name = name;
+    }
 }
 
-/**
- *  \brief Set pixel color in PREV buffer.
- *
- *  \param x    Screen row number (0 is top)
- *  \param y    Screen col number (0 is left)
- *  \param color    Color to set at this pixel
- *  \param screen_pixels    Pointer to the screen buffer to write to
- */
-inline internal void ColorSetUnsafe(int x, int y, u32 color, u32 *screen_pixels)
+inline internal u64 TraceBegin(void)
 {
-    screen_pixels[x*SCREEN_WIDTH+y] = color;
+    return SDL_AtomicGet(&trace_on) ? SDL_GetPerformanceCounter() : 0;
 }
 
 /**
- *  \brief Get particle momentum
- *
- *  \param x    Screen row number (0 is top)
- *  \param y    Screen col number (0 is left)
- *  \param momentum Pointer to the momentum buffer
+ *  \brief Record a complete event that started at `begin`.
  *
- *  \return momentum_t {i16 dx, i16 dy}
+ *  \param name Event name (must be a string literal)
+ *  \param cat  Event category (must be a string literal)
+ *  \param begin Return value of TraceBegin()
+ *  \param arg  Shows up as "arg" in the viewer, or -1 for no arg
  */
-inline internal momentum_t MomentumAt(int x, int y, momentum_t *momentum)
+inline internal void TraceEnd(const char *name, const char *cat, u64 begin, int arg)
 {
-    if ((x >= 0) && (y >= 0) && (x < SCREEN_HEIGHT) && (y < SCREEN_WIDTH))
+    if (!SDL_AtomicGet(&trace_on)) return;
+    if (begin == 0) return; // started before the recording did
+    u64 end = SDL_GetPerformanceCounter();
+    int i = SDL_AtomicAdd(&trace_nevents, 1);
+    if (i >= TRACE_MAX_EVENTS) return; // full: drop it
+    trace_event_t *e = &trace_events[i];
+    e->name = name;
+    e->cat = cat;
+    e->begin = begin;
+    e->end = end;
+    e->tid = (u32)SDL_ThreadID();
+    e->arg = arg;
+}
+
+internal void TraceStart(void)
+{
+    if (SDL_AtomicGet(&trace_on)) return; // already recording
+    SDL_AtomicSet(&trace_nevents, 0);
+    trace_frames_left = TRACE_FRAMES;
+    trace_start = SDL_GetPerformanceCounter();
+    SDL_AtomicSet(&trace_on, 1);
+    sprintf(log_msg, "Trace: recording %d frames...\n", TRACE_FRAMES);
+    log_to_file(log_msg);
+}
+
+internal void TraceWrite(const char *path)
+{
+    FILE *trace_file = fopen(path, "w");
+    if (!trace_file)
     {
-        return momentum[x*SCREEN_WIDTH+y];
+        sprintf(log_msg, "Trace: FAIL cannot open %s\n", path);
+        log_to_file(log_msg);
+        return;
     }
-    else // Pixel is outside screen area
+    // Timestamps are microseconds since TraceStart.
+    double us_per_tick = 1e6 / (double)SDL_GetPerformanceFrequency();
+    int nevents = intmin(SDL_AtomicGet(&trace_nevents), TRACE_MAX_EVENTS);
+    int nthreads = intmin(SDL_AtomicGet(&trace_nthreads), TRACE_MAX_THREADS);
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i=0; i < nthreads; i++)
     {
-        // Gotta return something. How about 0,0?
-        momentum_t out_of_bounds_momentum = {0,0};
-        return out_of_bounds_momentum;
+        fprintf(trace_file,
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s\"}},\n",
+                trace_threads[i].tid, trace_threads[i].name);
+    }
+    for (int i=0; i < nevents; i++)
+    {
+        trace_event_t *e = &trace_events[i];
+        fprintf(trace_file,
+                "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f",
+                e->name, e->cat, e->tid,
+                (double)(e->begin - trace_start) * us_per_tick,
+                (double)(e->end - e->begin) * us_per_tick);
+        if (e->arg >= 0) fprintf(trace_file, ",\"args\":{\"arg\":%d}", e->arg);
+        fprintf(trace_file, "}%s\n", (i+1 < nevents) ? "," : "");
     }
+    fprintf(trace_file, "]}\n");
+    fclose(trace_file);
+    sprintf(log_msg, "Trace: wrote %d events to %s%s\n",
+            nevents, path,
+            (SDL_AtomicGet(&trace_nevents) > TRACE_MAX_EVENTS) ? " (buffer full, dropped the rest)" : "");
+    log_to_file(log_msg);
 }
 
 /**
- *  \brief Get pixel color
+ *  \brief Call once at the end of every frame.
  *
- *  \param x    Screen row number (0 is top)
- *  \param y    Screen col number (0 is left)
- *  \param screen_pixels    Pointer to the screen buffer
+ *  Stops recording and writes trace.json after TRACE_FRAMES frames.
+ */
+internal void TraceFrameDone(void)
+{
+    if (!SDL_AtomicGet(&trace_on)) return;
+    if (--trace_frames_left > 0) return;
+    SDL_AtomicSet(&trace_on, 0);
+    TraceWrite("trace.json");
+}
+
+
+// -----------
+// | Job lib |
+// -----------
+
+/** Work-stealing jobs
  *
- *  \return color   ARGB as unsigned 32-bit, or 1 if (x,y) is outside screen
+ *      ./falling-something --threads N
+ *
+ * One pool of threads for all work that splits into independent
+ * pieces (simulation bands, pyramid chunks, dirty rects), so no
+ * feature needs threads of its own. The main thread is worker 0 and
+ * SDL threads are workers 1..N-1. The default N is the CPU count;
+ * N=1 runs every job on the main thread.
+ *
+ * Usage:
+ *      SDL_atomic_t counter = {0};
+ *      JobsFork(&counter, DoPiece, data, npieces);
+ *      JobsJoin(&counter); // DoPiece(data, 0..npieces-1) are all done
+ *
+ * JobsFork deals the jobs round-robin onto the workers' deques.
+ * A worker pops jobs off the back of its own deque and, when that
+ * is empty, steals from the front of another. Each deque has a spin
+ * lock, held to push, pop or steal, never while a job runs.
+ * JobsJoin runs jobs on the main thread until the counter is 0.
+ *
+ * Fork and join from the main thread only. Jobs must not call SDL
+ * video functions.
  */
-inline internal u32 ColorAt(int x, int y, u32 *screen_pixels)
+#define MAX_WORKERS 16
+#define JOB_DEQUE_SIZE 1024 // per worker, power of two
+
+typedef void job_fn_t(void *data, int index);
+
+typedef struct
 {
-    if ((x >= 0) && (y >= 0) && (x < SCREEN_HEIGHT) && (y < SCREEN_WIDTH))
+    job_fn_t *fn;
+    void *data;
+    int index;
+    SDL_atomic_t *counter; // jobs of this fork not done yet
+} job_t;
+
+typedef struct
+{
+    SDL_SpinLock lock;
+    int head; // steal from here
+    int tail; // push and pop here
+    job_t jobs[JOB_DEQUE_SIZE];
+    SDL_atomic_t tid; // Linux thread id, for the benchmark's counters (0 until known)
+    // Utilisation since the last JobsReport, written only by this worker
+    u64 busy_ticks;
+    u32 njobs;
+    u32 nstolen;
+} worker_t;
+
+typedef struct
+{
+    int nworkers; // including the main thread
+    worker_t workers[MAX_WORKERS];
+    SDL_Thread *threads[MAX_WORKERS];
+    SDL_sem *wake; // posted when there are jobs for sleeping workers
+    SDL_atomic_t quit;
+    u64 report_start;
+} job_system_t;
+
+job_system_t job_system;
+
+internal bool JobPush(worker_t *w, job_t job)
+{
+    bool pushed = false;
+    SDL_AtomicLock(&w->lock);
+    if (w->tail - w->head < JOB_DEQUE_SIZE)
     {
-        return screen_pixels[x*SCREEN_WIDTH+y];
+        w->jobs[w->tail++ & (JOB_DEQUE_SIZE - 1)] = job;
+        pushed = true;
     }
-    else // Pixel is outside screen area
+    SDL_AtomicUnlock(&w->lock);
+    return pushed;
+}
+
+internal bool JobPop(worker_t *w, job_t *job)
+{
+    bool popped = false;
+    SDL_AtomicLock(&w->lock);
+    if (w->tail > w->head)
     {
-        // Any value that is NOT the "NOTHING_COLOR" acts as a boundary
-        assert(NOTHING_COLOR != OUT_OF_BOUNDS_COLOR);
-        return OUT_OF_BOUNDS_COLOR;
+        *job = w->jobs[--w->tail & (JOB_DEQUE_SIZE - 1)];
+        popped = true;
     }
+    SDL_AtomicUnlock(&w->lock);
+    return popped;
 }
 
+internal bool JobSteal(worker_t *w, job_t *job)
+{
+    bool stolen = false;
+    SDL_AtomicLock(&w->lock);
+    if (w->tail > w->head)
+    {
+        *job = w->jobs[w->head++ & (JOB_DEQUE_SIZE - 1)];
+        stolen = true;
+    }
+    SDL_AtomicUnlock(&w->lock);
+    return stolen;
+}
 
 /**
- *  \brief Initial position and drawing of particles in the screen buffer
+ *  \brief Run one job: from worker self's deque, else stolen.
  *
- *  \param screen_pixels    Pointer to the screen buffer to write to
- *  \param nseed_particles Number of particles to initialize
- *  \param type ALL_TYPES for all types or specify one type,
- *  e.g., SAND for sand only. For specific types, I reduce the
- *  footprint for where the new particles originate.
+ *  \return false if every deque is empty.
  */
-internal void InitParticles(u32 * screen_pixels, u32 nseed_particles, enum particle_type type)
+internal bool JobRunOne(int self)
+{
+    worker_t *w = &job_system.workers[self];
+    job_t job;
+    bool stolen = false;
+    if (!JobPop(w, &job))
+    {
+        for (int k=1; (k < job_system.nworkers) && !stolen; k++)
+        {
+            stolen = JobSteal(&job_system.workers[(self + k) % job_system.nworkers], &job);
+        }
+        if (!stolen) return false;
+    }
+    u64 t0 = SDL_GetPerformanceCounter();
+    job.fn(job.data, job.index);
+    w->busy_ticks += SDL_GetPerformanceCounter() - t0;
+    w->njobs++;
+    if (stolen) w->nstolen++;
+    SDL_AtomicAdd(job.counter, -1);
+    return true;
+}
+
+internal int JobWorkerThread(void *data)
+{
+    int self = (int)(intptr_t)data;
+    TraceNameThread("job worker");
+#ifdef __linux__
+    SDL_AtomicSet(&job_system.workers[self].tid, (int)syscall(SYS_gettid));
+#endif
+    while (!SDL_AtomicGet(&job_system.quit))
+    {
+        if (!JobRunOne(self)) SDL_SemWait(job_system.wake);
+    }
+    return 0;
+}
+
+internal void JobsResetStats(void)
+{
+    for (int i=0; i < job_system.nworkers; i++)
+    {
+        worker_t *w = &job_system.workers[i];
+        w->busy_ticks = 0;
+        w->njobs = 0;
+        w->nstolen = 0;
+    }
+    job_system.report_start = SDL_GetPerformanceCounter();
+}
+
+/**
+ *  \brief Start the worker threads.
+ *
+ *  \param nworkers Workers including the main thread, or 0 for one
+ *                  per CPU
+ */
+internal void JobsInit(int nworkers)
+{
+    memset(&job_system, 0, sizeof(job_system));
+    if (nworkers < 1) nworkers = SDL_GetCPUCount();
+    nworkers = intmax(1, intmin(nworkers, MAX_WORKERS));
+    // Set before any worker runs: workers read it to find deques to steal from.
+    job_system.nworkers = nworkers;
+#ifdef __linux__
+    SDL_AtomicSet(&job_system.workers[0].tid, (int)syscall(SYS_gettid));
+#endif
+    job_system.wake = SDL_CreateSemaphore(0);
+    assert(job_system.wake);
+    for (int i=1; i < nworkers; i++)
+    {
+        job_system.threads[i] = SDL_CreateThread(JobWorkerThread, "job worker", (void*)(intptr_t)i);
+        if (!job_system.threads[i])
+        {
+            // Its deque still gets jobs, and the others steal them.
+            sprintf(log_msg, "Jobs: FAIL cannot start worker %d: %s\n", i, SDL_GetError());
+            log_to_file(log_msg);
+        }
+    }
+    JobsResetStats();
+    sprintf(log_msg, "Jobs: %d workers (main thread + %d threads)\n",
+            job_system.nworkers, job_system.nworkers - 1);
+    log_to_file(log_msg);
+}
+
+/**
+ *  \brief Queue fn(data, 0..njobs-1) and add njobs to *counter.
+ */
+internal void JobsFork(SDL_atomic_t *counter, job_fn_t *fn, void *data, int njobs)
+{
+    SDL_AtomicAdd(counter, njobs);
+    for (int i=0; i < njobs; i++)
+    {
+        job_t job = {fn, data, i, counter};
+        if (!JobPush(&job_system.workers[i % job_system.nworkers], job))
+        {
+            // Deque full: no queue, just do it.
+            fn(data, i);
+            SDL_AtomicAdd(counter, -1);
+        }
+    }
+    int nwake = intmin(njobs, job_system.nworkers - 1);
+    for (int i=0; i < nwake; i++) SDL_SemPost(job_system.wake);
+}
+
+/**
+ *  \brief Help run jobs until every job forked on counter is done.
+ */
+internal void JobsJoin(SDL_atomic_t *counter)
+{
+    int nspins = 0;
+    while (SDL_AtomicGet(counter) > 0)
+    {
+        if (JobRunOne(0)) continue;
+        // The last jobs are running on other workers.
+        if (++nspins % 256 == 0)
+        {
+            SDL_Delay(0); // more threads than CPUs: let them run
+        }
+#ifdef __SSE2__
+        else _mm_pause();
+#endif
+    }
+}
+
+/**
+ *  \brief Log how busy each worker was since the last report.
+ *
+ *  \param print Also print to stdout (the benchmark)
+ */
+internal void JobsReport(bool print)
+{
+    double elapsed = (double)(SDL_GetPerformanceCounter() - job_system.report_start);
+    if (elapsed <= 0) elapsed = 1;
+    for (int i=0; i < job_system.nworkers; i++)
+    {
+        worker_t *w = &job_system.workers[i];
+        sprintf(log_msg, "\tworker %2d: %5.1f%% busy, %u jobs, %u stolen\n",
+                i, 100.0 * (double)w->busy_ticks / elapsed, w->njobs, w->nstolen);
+        log_to_file(log_msg);
+        if (print) printf("%s", log_msg);
+    }
+    JobsResetStats();
+}
+
+internal void JobsShutdown(void)
+{
+    SDL_AtomicSet(&job_system.quit, 1);
+    for (int i=1; i < job_system.nworkers; i++) SDL_SemPost(job_system.wake);
+    for (int i=1; i < job_system.nworkers; i++)
+    {
+        if (job_system.threads[i]) SDL_WaitThread(job_system.threads[i], NULL);
+    }
+    log_to_file("Jobs: utilisation\n");
+    JobsReport(false);
+    SDL_DestroySemaphore(job_system.wake);
+    job_system.wake = NULL;
+}
+
+
+// ---------------
+// | Drawing lib |
+// ---------------
+
+#define SCREEN_WIDTH 200
+#define SCREEN_HEIGHT 150
+/* #define SCREEN_WIDTH 1280 */
+/* #define SCREEN_HEIGHT 760 */
+// The view is the part of the world in the window. SCREEN_WIDTH x
+// SCREEN_HEIGHT is the world. Make it bigger than the view for a
+// world that does not fit on screen.
+#define VIEW_WIDTH  SCREEN_WIDTH
+#define VIEW_HEIGHT SCREEN_HEIGHT
+#define PIXEL_SCALE 4
+/* #define PIXEL_SCALE 1 */
+#define SCALED_SCREEN_WIDTH  (PIXEL_SCALE*VIEW_WIDTH)
+#define SCALED_SCREEN_HEIGHT (PIXEL_SCALE*VIEW_HEIGHT)
+
+// The simulation works through the screen in chunks.
+// A "chunk row" is a band of CHUNK_SIZE screen rows.
+#define CHUNK_SIZE 16
+#define NCHUNK_ROWS ((SCREEN_HEIGHT + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define NCHUNK_COLS ((SCREEN_WIDTH  + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define NCHUNKS (NCHUNK_ROWS * NCHUNK_COLS)
+
+/** Dirty chunks
+ *
+ * A chunk is dirty if any of its pixels changed since the screen
+ * texture was last uploaded. Whatever changes pixels (particles
+ * moving, spawning, the cursor) marks the chunks it touched. The
+ * renderer uploads only dirty chunks, then clears the flags.
+ */
+u8 chunk_dirty[NCHUNKS];
+
+/**
+ *  \brief Mark the chunk holding pixel (x,y) dirty.
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ */
+inline internal void MarkDirty(int x, int y)
+{
+    if ((x >= 0) && (y >= 0) && (x < SCREEN_HEIGHT) && (y < SCREEN_WIDTH))
+    {
+        chunk_dirty[(x/CHUNK_SIZE)*NCHUNK_COLS + y/CHUNK_SIZE] = 1;
+    }
+}
+
+internal void MarkAllDirty(void)
+{
+    memset(chunk_dirty, 1, sizeof(chunk_dirty));
+}
+
+// ------------
+// | Momentum |
+// ------------
+
+typedef struct
+{
+    i16 dx; // vertical (think rows)
+    i16 dy; // horizontal (think cols)
+} momentum_t;
+
+
+/** Types of artwork
+ *
+ * Green cursor is a rect_t.
+ * Everything else is drawn pixel-by-pixel Noita style.
+ * Colors are ARGBA: 0xAARRGGBB.
+ * x,y conventions:
+ *  Cursor artwork: x is COL, y is ROW
+ *  Pixel artwork:  x is ROW, y is COL
+ */
+
+// ------------------
+// | Background art |
+// ------------------
+
+#define NOTHING_COLOR       0x00000000
+#define OUT_OF_BOUNDS_COLOR 0x00000001
+#define BGND_COLOR       0x40221100
+/* #define NO_FLICKER       0x01010101 */
+/* #define BGND_FLICKER    (0x80552233 - BGND_COLOR) */
+#define BGND_FLICKER    (0x80000000 - (BGND_COLOR&0xFF000000) + (BGND_COLOR&0x00FFFFFF) + 0x00020202)
+
+// --------------
+// | Cursor art |
+// --------------
+
+typedef struct
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} rect_t;
+
+/**
+ *  \brief Mark the chunks under a cursor-style rect dirty.
+ */
+internal void MarkDirtyRect(rect_t rect)
+{
+    int row_first = intmax(rect.y, 0) / CHUNK_SIZE;
+    int row_last  = (intmin(rect.y + rect.h, SCREEN_HEIGHT) - 1) / CHUNK_SIZE;
+    int col_first = intmax(rect.x, 0) / CHUNK_SIZE;
+    int col_last  = (intmin(rect.x + rect.w, SCREEN_WIDTH) - 1) / CHUNK_SIZE;
+    for (int chunk_row=row_first; chunk_row <= row_last; chunk_row++)
+    {
+        for (int chunk_col=col_first; chunk_col <= col_last; chunk_col++)
+        {
+            chunk_dirty[chunk_row*NCHUNK_COLS + chunk_col] = 1;
+        }
+    }
+}
+
+internal void FillRect(rect_t rect, u32 pixel_color, u32 *screen_pixels_prev)
+{
+    assert(screen_pixels_prev);
+    for (int row=0; row < rect.h; row++)
+    {
+        for (int col=0; col < rect.w; col++)
+        {
+            screen_pixels_prev[ (row + rect.y)*SCREEN_WIDTH + (col + rect.x) ] = pixel_color;
+        }
+    }
+}
+
+// -------------
+// | Pixel art |
+// -------------
+
+// Each pixel is a particle.
+
+// Number of particles to simulate
+#define NP 2000 // program aborts if NP > (SCREEN_WIDTH * SCREEN_HEIGHT)
+
+// NTYPES: Number of particle types
+#define NTYPES 7
+#define ALL_TYPES NTYPES
+
+enum particle_type
+{
+    SAND,
+    SLIME,
+    WATER,
+    BRICK,
+    SMOKE, // gases rise and drift, see Gas lib
+    STEAM,
+    FIRE   // stays put and reacts, see Reaction lib
+};
+
+// RGBA is not available!
+/* #define SAND_COLOR  0xFFBB0010 */
+/* #define WATER_COLOR 0x0088FF10 */
+/* #define SLIME_COLOR 0xFF88FF10 */
+/* #define BRICK_COLOR 0xFF000010 */
+
+// ARGB8888
+#define SAND_COLOR  0xFFFFBB00
+#define WATER_COLOR 0xC00088FF
+#define SLIME_COLOR 0xD0FF88FF
+#define BRICK_COLOR 0xFFFF0000
+#define SMOKE_COLOR 0x90505050
+#define STEAM_COLOR 0x70D0E0F0
+#define FIRE_COLOR  0xF0FF7020
+
+static const u32 colors[NTYPES] = { // in enum particle_type order
+    SAND_COLOR,
+    SLIME_COLOR,
+    WATER_COLOR,
+    BRICK_COLOR,
+    SMOKE_COLOR,
+    STEAM_COLOR,
+    FIRE_COLOR
+};
+
+// ---------
+// | Looks |
+// ---------
+
+/** What a cell looks like
+ *
+ * The simulation keys on colour, so every grain of sand is exactly
+ * SAND_COLOR. What is drawn comes from the cell's look: a material
+ * and one of NSHADES shades of it. A grain's shade is picked when
+ * it spawns and moves with the grain. The colour pass turns looks
+ * into pixels with a palette lookup per cell and no branches.
+ *
+ * A cell has two layers, so a look_t holds two looks: the cell's
+ * own material in the low byte and a film in front of it in the
+ * high byte (LOOK_NOTHING for no film). Sand that touches water gets
+ * a film of water and stays wet. The colour pass blends the film
+ * over the material in the same pass as the palette lookup.
+ */
+#define NSHADES 8
+
+typedef u16 look_t;
+#define LOOK_BACK(look)  ((look) & 0xFF)
+#define LOOK_FRONT(look) ((look) >> 8)
+#define WITH_FILM(look, film) ((look_t)(LOOK_BACK(look) | ((film) << 8)))
+
+enum look_material
+{
+    LOOK_NOTHING, // must be 0: zeroed looks are empty
+    LOOK_SAND,
+    LOOK_WATER,
+    LOOK_SLIME,
+    LOOK_BRICK,
+    LOOK_ME,
+    LOOK_WET, // film of water
+    LOOK_SMOKE,
+    LOOK_STEAM,
+    LOOK_FIRE,
+    NLOOK_MATERIALS
+};
+
+#define LOOK(material, shade) ((u8)((material)*NSHADES + (shade)))
+
+u32 palette[256]; // one layer of a look -> ARGB
+
+/**
+ *  \brief Fill the palette with NSHADES brightnesses per material.
+ *
+ *  Shades go from 84% to 116% of the material color. Nothing, the
+ *  cursor and films have one shade.
+ *
+ *  \param me_color Color of the cursor
+ */
+internal void PaletteInit(u32 me_color)
+{
+    assert(NLOOK_MATERIALS*NSHADES <= 256);
+    const u32 base[NLOOK_MATERIALS] = {
+        NOTHING_COLOR,
+        SAND_COLOR,
+        WATER_COLOR,
+        SLIME_COLOR,
+        BRICK_COLOR,
+        me_color,
+        (WATER_COLOR & 0x00FFFFFF) | 0x60000000, // thinner than water
+        SMOKE_COLOR,
+        STEAM_COLOR,
+        FIRE_COLOR
+    };
+    for (int m=0; m < NLOOK_MATERIALS; m++)
+    {
+        for (int shade=0; shade < NSHADES; shade++)
+        {
+            u32 scale = 216 + shade*80/(NSHADES-1); // 256 is 100%
+            if ((m == LOOK_NOTHING) || (m == LOOK_ME) || (m == LOOK_WET)) scale = 256;
+            u32 out = base[m] & 0xFF000000;
+            for (int shift=0; shift < 24; shift += 8)
+            {
+                u32 channel = (((base[m] >> shift) & 0xFF) * scale) >> 8;
+                out |= intmin(channel, 255) << shift;
+            }
+            palette[LOOK(m, shade)] = out;
+        }
+    }
+}
+
+/**
+ *  \brief Colour n cells: front layer blended over back layer.
+ *
+ *      dst[i] = BlendPixel(palette[front], palette[back])
+ *
+ *  No film is a transparent front, which leaves back as it is. With
+ *  AVX2, eight cells per pair of gathers; with SSE2, four per blend.
+ */
+inline internal void PaletteRow(u32 *dst, const look_t *looks, int n)
+{
+    int i = 0;
+#ifdef __AVX2__
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i look  = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&looks[i]));
+        __m256i back  = _mm256_i32gather_epi32((const int*)palette, _mm256_and_si256(look, low_byte), sizeof(u32));
+        __m256i front = _mm256_i32gather_epi32((const int*)palette, _mm256_srli_epi32(look, 8), sizeof(u32));
+        _mm_storeu_si128((__m128i*)&dst[i],
+                BlendPixels4(_mm256_castsi256_si128(front), _mm256_castsi256_si128(back)));
+        _mm_storeu_si128((__m128i*)&dst[i + 4],
+                BlendPixels4(_mm256_extracti128_si256(front, 1), _mm256_extracti128_si256(back, 1)));
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i back = _mm_set_epi32(
+                (int)palette[LOOK_BACK(looks[i + 3])], (int)palette[LOOK_BACK(looks[i + 2])],
+                (int)palette[LOOK_BACK(looks[i + 1])], (int)palette[LOOK_BACK(looks[i + 0])]);
+        __m128i front = _mm_set_epi32(
+                (int)palette[LOOK_FRONT(looks[i + 3])], (int)palette[LOOK_FRONT(looks[i + 2])],
+                (int)palette[LOOK_FRONT(looks[i + 1])], (int)palette[LOOK_FRONT(looks[i + 0])]);
+        _mm_storeu_si128((__m128i*)&dst[i], BlendPixels4(front, back));
+    }
+#endif
+    for (; i < n; i++)
+    {
+        dst[i] = BlendPixel(palette[LOOK_FRONT(looks[i])], palette[LOOK_BACK(looks[i])]);
+    }
+}
+
+/**
+ *  \brief FillRect for looks.
+ */
+internal void FillLookRect(rect_t rect, look_t look, look_t *looks)
+{
+    for (int row=0; row < rect.h; row++)
+    {
+        for (int col=0; col < rect.w; col++)
+        {
+            looks[ (row + rect.y)*SCREEN_WIDTH + (col + rect.x) ] = look;
+        }
+    }
+}
+
+/** How pixel coordinates work
+ *
+ * x is row number (vertical), with 0 at top of screen
+ * y is col number, with 0 at left of screen
+ *
+ *  index of pixel at row x, col 0 is:
+ *       row number * screen width
+ *  then hop to pixel in column y:
+ *       + y
+ */
+
+/**
+ *  \brief Set momentum in PREV buffer.
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ *  \param momentum Momentum to set at this pixel
+ *  \param momentum_buffer Pointer to the momentum buffer to write to
+ */
+inline internal void MomentumSetUnsafe(int x, int y, momentum_t momentum, momentum_t * momentum_buffer)
+{
+    momentum_buffer[x*SCREEN_WIDTH+y] = momentum;
+}
+
+/**
+ *  \brief Set pixel color in PREV buffer.
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ *  \param color    Color to set at this pixel
+ *  \param screen_pixels    Pointer to the screen buffer to write to
+ */
+inline internal void ColorSetUnsafe(int x, int y, u32 color, u32 *screen_pixels)
+{
+    screen_pixels[x*SCREEN_WIDTH+y] = color;
+}
+
+/**
+ *  \brief Set pixel look.
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ *  \param look LOOK(material, shade), maybe WITH_FILM
+ *  \param looks    Pointer to the look buffer to write to
+ */
+inline internal void LookSetUnsafe(int x, int y, look_t look, look_t *looks)
+{
+    looks[x*SCREEN_WIDTH+y] = look;
+}
+
+/**
+ *  \brief Get particle momentum
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ *  \param momentum Pointer to the momentum buffer
+ *
+ *  \return momentum_t {i16 dx, i16 dy}
+ */
+inline internal momentum_t MomentumAt(int x, int y, momentum_t *momentum)
+{
+    if ((x >= 0) && (y >= 0) && (x < SCREEN_HEIGHT) && (y < SCREEN_WIDTH))
+    {
+        return momentum[x*SCREEN_WIDTH+y];
+    }
+    else // Pixel is outside screen area
+    {
+        // Gotta return something. How about 0,0?
+        momentum_t out_of_bounds_momentum = {0,0};
+        return out_of_bounds_momentum;
+    }
+}
+
+/**
+ *  \brief Get pixel color
+ *
+ *  \param x    Screen row number (0 is top)
+ *  \param y    Screen col number (0 is left)
+ *  \param screen_pixels    Pointer to the screen buffer
+ *
+ *  \return color   ARGB as unsigned 32-bit, or 1 if (x,y) is outside screen
+ */
+inline internal u32 ColorAt(int x, int y, u32 *screen_pixels)
+{
+    if ((x >= 0) && (y >= 0) && (x < SCREEN_HEIGHT) && (y < SCREEN_WIDTH))
+    {
+        return screen_pixels[x*SCREEN_WIDTH+y];
+    }
+    else // Pixel is outside screen area
+    {
+        // Any value that is NOT the "NOTHING_COLOR" acts as a boundary
+        assert(NOTHING_COLOR != OUT_OF_BOUNDS_COLOR);
+        return OUT_OF_BOUNDS_COLOR;
+    }
+}
+
+
+// ------------------
+// | Population lib |
+// ------------------
+
+/** Who is where
+ *
+ * Counts of particles (sand, slime, water, gases; not the brick border)
+ * that are kept up to date as cells change: spawned, moved, erased,
+ * overwritten or thinned out (gas). So checking that nothing is made or lost, or
+ * showing how much of everything there is, costs no grid scan.
+ *
+ * A particle that lands on another in NEXT overwrites it: that one
+ * is lost. The simulation counts what it loses (and what gas thins
+ * out) per chunk row and adds it up after the tick.
+ */
+typedef struct
+{
+    int material[NTYPES];       // particles of each type
+    int row[SCREEN_HEIGHT];     // particles in each row
+    int chunk_active[NCHUNKS];  // particles that moved, last tick
+    int band_lost[NCHUNK_ROWS][NTYPES]; // overwritten, per chunk row
+    int band_faded[NCHUNK_ROWS][NTYPES]; // gone by themselves (gas), per chunk row
+    int lost[NTYPES];           // overwritten, last tick
+    u64 lost_total;             // overwritten, ever
+} population_t;
+
+population_t population;
+
+/**
+ *  \brief Which particle has this color.
+ *
+ *  \return particle type, or -1 for anything that is not a particle
+ */
+inline internal int ParticleOf(u32 color)
+{
+    switch (color)
+    {
+        case SAND_COLOR:  return SAND;
+        case SLIME_COLOR: return SLIME;
+        case WATER_COLOR: return WATER;
+        case SMOKE_COLOR: return SMOKE;
+        case STEAM_COLOR: return STEAM;
+        case FIRE_COLOR:  return FIRE;
+        default:          return -1;
+    }
+}
+
+/**
+ *  \brief Count a particle of this color in (or, for count -1,
+ *  out of) row x.
+ */
+inline internal void PopulationAdd(int x, u32 color, int count)
+{
+    int type = ParticleOf(color);
+    if (type < 0) return;
+    population.material[type] += count;
+    population.row[x] += count;
+}
+
+/**
+ *  \brief Count every particle in rect in (count 1) or out (count -1).
+ *
+ *  Call with -1 just before rect is overwritten.
+ */
+internal void PopulationRect(rect_t rect, const u32 *screen_pixels, int count)
+{
+    int row_end = intmin(rect.y + rect.h, SCREEN_HEIGHT);
+    int col_end = intmin(rect.x + rect.w, SCREEN_WIDTH);
+    for (int row=intmax(rect.y, 0); row < row_end; row++)
+    {
+        for (int col=intmax(rect.x, 0); col < col_end; col++)
+        {
+            PopulationAdd(row, screen_pixels[row*SCREEN_WIDTH + col], count);
+        }
+    }
+}
+
+/**
+ *  \brief Count the whole world from scratch.
+ */
+internal void PopulationReset(const u32 *screen_pixels)
+{
+    memset(&population, 0, sizeof(population));
+    rect_t world = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    PopulationRect(world, screen_pixels, 1);
+}
+
+internal int PopulationTotal(void)
+{
+    int total = 0;
+    for (int type=0; type < NTYPES; type++) total += population.material[type];
+    return total;
+}
+
+/**
+ *  \brief Conservation check: do the counts match the world?
+ *
+ *  Scans the whole grid, so this is for tests and logs, not every
+ *  frame.
+ */
+internal bool PopulationCheck(const u32 *screen_pixels)
+{
+    int material[NTYPES] = {0};
+    bool ok = true;
+    for (int row=0; row < SCREEN_HEIGHT; row++)
+    {
+        int nrow = 0;
+        for (int col=0; col < SCREEN_WIDTH; col++)
+        {
+            int type = ParticleOf(screen_pixels[row*SCREEN_WIDTH + col]);
+            if (type < 0) continue;
+            material[type]++;
+            nrow++;
+        }
+        if (nrow != population.row[row]) ok = false;
+    }
+    for (int type=0; type < NTYPES; type++)
+    {
+        if (material[type] != population.material[type]) ok = false;
+    }
+    return ok;
+}
+
+// The title bar shows the counts, this often.
+#define HUD_FRAMES 15
+
+/**
+ *  \brief The counts, for the title bar.
+ */
+internal void PopulationHud(char *text, const char *prefix)
+{
+    int lost = 0;
+    for (int type=0; type < NTYPES; type++) lost += population.lost[type];
+    sprintf(text, "%s | sand %d  slime %d  water %d  gas %d  fire %d  lost %d/tick",
+            prefix, population.material[SAND], population.material[SLIME],
+            population.material[WATER], population.material[SMOKE] + population.material[STEAM],
+            population.material[FIRE], lost);
+}
+
+internal void PopulationLog(void)
+{
+    sprintf(log_msg, "Population: sand %d, slime %d, water %d, smoke %d, steam %d, fire %d; lost %llu to overwrites\n",
+            population.material[SAND], population.material[SLIME], population.material[WATER],
+            population.material[SMOKE], population.material[STEAM], population.material[FIRE],
+            (unsigned long long)population.lost_total);
+    log_to_file(log_msg);
+}
+
+// ---------------
+// | Heatmap lib |
+// ---------------
+
+/** Where the simulation spends its time
+ *
+ * Press `a` to tint every chunk in the view by its activity: faint
+ * blue if nothing in it changed this tick; otherwise green to red
+ * by what it cost to simulate (relative to the costliest chunk),
+ * more opaque the more particles moved in it. The overlay takes
+ * the place of the alpha experiment layers. HeatmapDraw is in the
+ * Render lib.
+ *
+ * Chunks are timed only while the overlay is shown. SimulateBand
+ * reads the clock at each chunk boundary of each row, so the time
+ * includes a little clock overhead.
+ */
+typedef struct
+{
+    bool on;
+    u64 chunk_ticks[NCHUNKS]; // performance counter ticks, last tick
+} heatmap_t;
+
+heatmap_t heatmap;
+
+/**
+ *  \brief Charge the time since the last lap to the chunk left of
+ *  (x,y), then start the next lap.
+ *
+ *  \param y    Column of the chunk boundary (0 just starts a lap)
+ */
+inline internal void HeatmapLap(u64 *lap, int x, int y)
+{
+    u64 now = SDL_GetPerformanceCounter();
+    if (y > 0) heatmap.chunk_ticks[(x/CHUNK_SIZE)*NCHUNK_COLS + (y - 1)/CHUNK_SIZE] += now - *lap;
+    *lap = now;
+}
+
+/**
+ *  \brief Initial position and drawing of particles in the screen buffer
+ *
+ *  \param screen_pixels    Pointer to the screen buffer to write to
+ *  \param looks    Pointer to the look buffer to write to
+ *  \param nseed_particles Number of particles to initialize
+ *  \param type ALL_TYPES for all types or specify one type,
+ *  e.g., SAND for sand only. For specific types, I reduce the
+ *  footprint for where the new particles originate.
+ */
+internal void InitParticles(u32 * screen_pixels, look_t *looks, u32 nseed_particles, enum particle_type type)
 {
     // Sample nseeds
     for (u32 i=0; i < nseed_particles; i++)
     {
-        // Pick new x,y
-        int y = rand() % (SCREEN_WIDTH-1);  // random col
-        int x = rand() % (SCREEN_HEIGHT-1); // random row in top-half of screen
-        // Limit specific particles to starting at the top of the screen
-        if (type != ALL_TYPES)
+        // Pick new x,y
+        int y = rand() % (SCREEN_WIDTH-1);  // random col
+        int x = rand() % (SCREEN_HEIGHT-1); // random row in top-half of screen
+        // Limit specific particles to starting at the top of the screen
+        if (type != ALL_TYPES)
+        {
+            y = rand() % SCREEN_WIDTH/2 + SCREEN_WIDTH/4;
+            x = rand() % SCREEN_HEIGHT/8;
+            // Gases start at the bottom and rise; fire starts where the slime pools.
+            if ((type == SMOKE) || (type == STEAM) || (type == FIRE)) x = SCREEN_HEIGHT - 2 - x;
+        }
+        // Only put new particles in empty space
+        if (ColorAt(x, y, screen_pixels) == NOTHING_COLOR)
+        {
+            MarkDirty(x, y);
+            // Let SAND be any particles between 1/m and 1/n of screen width
+            if ((type == SAND) || (type == ALL_TYPES))
+            {
+                if (
+                    ((1.0/5.0)*SCREEN_WIDTH < y )
+                    && (y < (3.0/5.0)*SCREEN_WIDTH)
+                   )
+                {
+                    ColorSetUnsafe(x, y, SAND_COLOR, screen_pixels);
+                    LookSetUnsafe(x, y, LOOK(LOOK_SAND, rand()%NSHADES), looks);
+                }
+            }
+            // And let WATER be to the RIGHT of SAND.
+            if ((type == WATER) || (type == ALL_TYPES))
+            {
+                if (
+                    ((2.5/5.0)*SCREEN_WIDTH < y )
+                    && (y < (4.0/5.0)*SCREEN_WIDTH)
+                   )
+                {
+                    ColorSetUnsafe(x, y, WATER_COLOR, screen_pixels);
+                    LookSetUnsafe(x, y, LOOK(LOOK_WATER, rand()%NSHADES), looks);
+                }
+            }
+            // And let SLIME be to the far RIGHT.
+            if ((type == SLIME) || (type == ALL_TYPES))
+            {
+                if (
+                    ((3.5/5.0)*SCREEN_WIDTH < y )
+                    && (y < (5.0/5.0)*SCREEN_WIDTH)
+                   )
+                {
+                    ColorSetUnsafe(x, y, SLIME_COLOR, screen_pixels);
+                    LookSetUnsafe(x, y, LOOK(LOOK_SLIME, rand()%NSHADES), looks);
+                }
+            }
+            // Gases only when asked for, anywhere across.
+            if (type == SMOKE)
+            {
+                ColorSetUnsafe(x, y, SMOKE_COLOR, screen_pixels);
+                LookSetUnsafe(x, y, LOOK(LOOK_SMOKE, rand()%NSHADES), looks);
+            }
+            if (type == STEAM)
+            {
+                ColorSetUnsafe(x, y, STEAM_COLOR, screen_pixels);
+                LookSetUnsafe(x, y, LOOK(LOOK_STEAM, rand()%NSHADES), looks);
+            }
+            if (type == FIRE)
+            {
+                ColorSetUnsafe(x, y, FIRE_COLOR, screen_pixels);
+                LookSetUnsafe(x, y, LOOK(LOOK_FIRE, rand()%NSHADES), looks);
+            }
+            // Count whatever ended up here (water can go over sand).
+            PopulationAdd(x, ColorAt(x, y, screen_pixels), 1);
+        }
+    }
+}
+
+// Bricks get a fixed pattern of shades.
+#define BRICK_LOOK(x, y) LOOK(LOOK_BRICK, ((x)*5 + (y)*3) % NSHADES)
+
+void internal DrawBorder(u32 * screen_pixels, look_t *looks)
+{
+        // ---Draw a border of bricks---
+        for (int x=0; x < SCREEN_HEIGHT; x++)
+        {
+            ColorSetUnsafe(x, 0, colors[BRICK], screen_pixels);
+            ColorSetUnsafe(x, SCREEN_WIDTH-1, colors[BRICK], screen_pixels);
+            LookSetUnsafe(x, 0, BRICK_LOOK(x, 0), looks);
+            LookSetUnsafe(x, SCREEN_WIDTH-1, BRICK_LOOK(x, SCREEN_WIDTH-1), looks);
+        }
+        for (int y=0; y < SCREEN_WIDTH; y++)
+        {
+            ColorSetUnsafe(0, y, colors[BRICK], screen_pixels);
+            ColorSetUnsafe(SCREEN_HEIGHT-1, y, colors[BRICK], screen_pixels);
+            LookSetUnsafe(0, y, BRICK_LOOK(0, y), looks);
+            LookSetUnsafe(SCREEN_HEIGHT-1, y, BRICK_LOOK(SCREEN_HEIGHT-1, y), looks);
+        }
+}
+
+/**
+ *  \brief A particle at (x,y) is about to move by momentum: mark
+ *  where it left and where it lands.
+ */
+inline internal void MarkMoved(int x, int y, momentum_t momentum)
+{
+    if (momentum.dx || momentum.dy)
+    {
+        MarkDirty(x, y);
+        MarkDirty(x + momentum.dx, y + momentum.dy);
+    }
+}
+
+/**
+ *  \brief A particle at (x,y) is about to land at (x,y) + momentum
+ *  in NEXT: keep the population counts up to date.
+ *
+ *  Only touches rows x-1 to x+1 (gases rise), and chunk row
+ *  x/CHUNK_SIZE, so chunk rows that run at the same time never
+ *  share a counter. (MarkMoved is looser: rising gas in chunk row r
+ *  and falling particles in chunk row r-2 can both mark a chunk of
+ *  row r-1 dirty. Both store 1, so it does not matter which wins.)
+ */
+inline internal void CountMoved(int x, int y, momentum_t momentum, const u32 *screen_pixels_next)
+{
+    int x_to = x + momentum.dx;
+    int overwritten = ParticleOf(screen_pixels_next[x_to*SCREEN_WIDTH + y + momentum.dy]);
+    if (overwritten >= 0)
+    {
+        population.band_lost[x/CHUNK_SIZE][overwritten]++;
+        population.row[x_to]--;
+    }
+    if (momentum.dx || momentum.dy)
+    {
+        population.chunk_active[(x/CHUNK_SIZE)*NCHUNK_COLS + y/CHUNK_SIZE]++;
+        population.row[x]--;
+        population.row[x_to]++;
+    }
+}
+
+// -----------
+// | Gas lib |
+// -----------
+
+/** Smoke and steam
+ *
+ * Gas cells get their motion from a coarse velocity field instead
+ * of from their neighbors: one gas cell per GAS_CELL x GAS_CELL
+ * world cells. Every GAS_STEP_TICKS ticks, and only while there is
+ * gas in the world, GasStep moves the field on:
+ *      forces: buoyancy pushes up where there is gas, a gust per
+ *              row of gas cells pushes sideways, drag slows all
+ *      advect: semi-Lagrangian, each gas cell takes the velocity
+ *              found a step back along its own velocity (bilinear)
+ *      walls:  no velocity into the edges of the world
+ * There is no pressure solve: drag keeps it tame.
+ *
+ * Back on the world grid, only gas cells read the field. A gas cell
+ * moves a cell up or down with probability |v|, and sideways with
+ * probability |u|, into cells that are empty in PREV and NEXT. In
+ * the same pass it counts itself, which is where the next GasStep
+ * gets its buoyancy.
+ *
+ * Gas thins out: each tick a gas cell is gone with a small chance,
+ * so smoke lasts about 10 s and steam about 6 s. Gas that stopped
+ * moving stops marking its chunk dirty, and gas does not keep
+ * chunks awake forever.
+ *
+ * Heavier particles sink through gas (see Density).
+ */
+#define GAS_SHIFT 3 // a gas cell is 8x8 world cells (CHUNK_SIZE must be a multiple)
+#define GAS_CELL (1 << GAS_SHIFT)
+#define GAS_WIDTH  ((SCREEN_WIDTH  + GAS_CELL - 1) >> GAS_SHIFT)
+#define GAS_HEIGHT ((SCREEN_HEIGHT + GAS_CELL - 1) >> GAS_SHIFT)
+#define GAS_STEP_TICKS 4
+// Velocities are in world cells per tick. Down is +v, right is +u.
+#define GAS_BUOYANCY 0.05f // per step, in a gas cell full of gas
+#define GAS_GUST     0.05f // per step, most a row of gas cells is pushed
+#define GAS_DRAG     0.9f  // per step
+#define GAS_LIFT_SMOKE 0.1f // world cells per tick: steam rises faster
+#define GAS_LIFT_STEAM 0.3f
+// Chance per tick that a gas cell is gone, as a XorShift32 threshold.
+#define GAS_FADE_SMOKE (0xFFFFFFFFu / 600)
+#define GAS_FADE_STEAM (0xFFFFFFFFu / 360)
+
+typedef struct
+{
+    float *u;       // GAS_WIDTH x GAS_HEIGHT
+    float *v;
+    float *u_prev;  // GasStep advects from these
+    float *v_prev;
+    int *count;     // gas cells in each gas cell, last tick
+    int tick;
+} gas_field_t;
+
+gas_field_t gas;
+
+internal void GasInit(arena_t *arena)
+{
+    const int n = GAS_WIDTH * GAS_HEIGHT;
+    gas.u      = (float*) ArenaGrid(arena, n, sizeof(float));
+    gas.v      = (float*) ArenaGrid(arena, n, sizeof(float));
+    gas.u_prev = (float*) ArenaGrid(arena, n, sizeof(float));
+    gas.v_prev = (float*) ArenaGrid(arena, n, sizeof(float));
+    gas.count  = (int*) ArenaGrid(arena, n, sizeof(int));
+    gas.tick = 0;
+}
+
+/**
+ *  \brief Bilinear sample of field at (x,y) in gas cells.
+ *
+ *  (x,y) must be in [0, GAS_WIDTH-1] x [0, GAS_HEIGHT-1].
+ */
+inline internal float GasSample(const float *field, float x, float y)
+{
+    int x0 = (int)x;
+    int y0 = (int)y;
+    float fx = x - (float)x0;
+    float fy = y - (float)y0;
+    int x1 = intmin(x0 + 1, GAS_WIDTH - 1);
+    int y1 = intmin(y0 + 1, GAS_HEIGHT - 1);
+    float top    = field[y0*GAS_WIDTH + x0] + fx*(field[y0*GAS_WIDTH + x1] - field[y0*GAS_WIDTH + x0]);
+    float bottom = field[y1*GAS_WIDTH + x0] + fx*(field[y1*GAS_WIDTH + x1] - field[y1*GAS_WIDTH + x0]);
+    return top + fy*(bottom - top);
+}
+
+/**
+ *  \brief Move the velocity field on by one step.
+ *
+ *  With SSE2, four gas cells at a time; the bilinear taps are
+ *  loaded one by one.
+ */
+internal void GasStep(u32 seed)
+{
+    u32 rng = seed | 1;
+    const float full = 1.0f / (GAS_CELL * GAS_CELL);
+    const float back = (float)GAS_STEP_TICKS / GAS_CELL; // world cells per tick -> gas cells per step
+    // ---Forces: into u_prev, v_prev---
+    for (int gy=0; gy < GAS_HEIGHT; gy++)
+    {
+        float gust = GAS_GUST * ((float)(XorShift32(&rng) & 0xFFFF) / 32768.0f - 1.0f);
+        const int *count = &gas.count[gy*GAS_WIDTH];
+        const float *u = &gas.u[gy*GAS_WIDTH];
+        const float *v = &gas.v[gy*GAS_WIDTH];
+        float *u_out = &gas.u_prev[gy*GAS_WIDTH];
+        float *v_out = &gas.v_prev[gy*GAS_WIDTH];
+        int gx = 0;
+#ifdef __SSE2__
+        const __m128 drag = _mm_set1_ps(GAS_DRAG);
+        const __m128 gust4 = _mm_set1_ps(gust);
+        const __m128 lift = _mm_set1_ps(GAS_BUOYANCY * full);
+        for (; gx + 4 <= GAS_WIDTH; gx += 4)
+        {
+            __m128 density = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&count[gx]));
+            _mm_storeu_ps(&u_out[gx], _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&u[gx]), gust4), drag));
+            _mm_storeu_ps(&v_out[gx], _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&v[gx]), _mm_mul_ps(density, lift)), drag));
+        }
+#endif
+        for (; gx < GAS_WIDTH; gx++)
+        {
+            u_out[gx] = (u[gx] + gust) * GAS_DRAG;
+            v_out[gx] = (v[gx] - GAS_BUOYANCY * full * (float)count[gx]) * GAS_DRAG;
+        }
+    }
+    // ---Advect: u_prev, v_prev into u, v---
+    for (int gy=0; gy < GAS_HEIGHT; gy++)
+    {
+        int gx = 0;
+        const float *u_in = &gas.u_prev[gy*GAS_WIDTH];
+        const float *v_in = &gas.v_prev[gy*GAS_WIDTH];
+#ifdef __SSE2__
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 x_max = _mm_set1_ps((float)(GAS_WIDTH - 1));
+        const __m128 y_max = _mm_set1_ps((float)(GAS_HEIGHT - 1));
+        const __m128 back4 = _mm_set1_ps(back);
+        const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        for (; gx + 4 <= GAS_WIDTH; gx += 4)
+        {
+            // Where each of the four came from, clamped to the field.
+            __m128 x = _mm_sub_ps(_mm_add_ps(_mm_set1_ps((float)gx), lanes), _mm_mul_ps(_mm_loadu_ps(&u_in[gx]), back4));
+            __m128 y = _mm_sub_ps(_mm_set1_ps((float)gy), _mm_mul_ps(_mm_loadu_ps(&v_in[gx]), back4));
+            x = _mm_min_ps(_mm_max_ps(x, zero), x_max);
+            y = _mm_min_ps(_mm_max_ps(y, zero), y_max);
+            __m128i x0 = _mm_cvttps_epi32(x);
+            __m128i y0 = _mm_cvttps_epi32(y);
+            __m128 fx = _mm_sub_ps(x, _mm_cvtepi32_ps(x0));
+            __m128 fy = _mm_sub_ps(y, _mm_cvtepi32_ps(y0));
+            int xs[4], ys[4];
+            _mm_storeu_si128((__m128i*)xs, x0);
+            _mm_storeu_si128((__m128i*)ys, y0);
+            float taps[2][4][4]; // field, corner, lane
+            for (int lane=0; lane < 4; lane++)
+            {
+                int i00 = ys[lane]*GAS_WIDTH + xs[lane];
+                int i01 = i00 + ((xs[lane] < GAS_WIDTH - 1) ? 1 : 0);
+                int i10 = i00 + ((ys[lane] < GAS_HEIGHT - 1) ? GAS_WIDTH : 0);
+                int i11 = i10 + (i01 - i00);
+                const float *fields[2] = {gas.u_prev, gas.v_prev};
+                for (int f=0; f < 2; f++)
+                {
+                    taps[f][0][lane] = fields[f][i00];
+                    taps[f][1][lane] = fields[f][i01];
+                    taps[f][2][lane] = fields[f][i10];
+                    taps[f][3][lane] = fields[f][i11];
+                }
+            }
+            float *outs[2] = {&gas.u[gy*GAS_WIDTH + gx], &gas.v[gy*GAS_WIDTH + gx]};
+            for (int f=0; f < 2; f++)
+            {
+                __m128 a = _mm_loadu_ps(taps[f][0]);
+                __m128 b = _mm_loadu_ps(taps[f][1]);
+                __m128 c = _mm_loadu_ps(taps[f][2]);
+                __m128 d = _mm_loadu_ps(taps[f][3]);
+                __m128 top    = _mm_add_ps(a, _mm_mul_ps(fx, _mm_sub_ps(b, a)));
+                __m128 bottom = _mm_add_ps(c, _mm_mul_ps(fx, _mm_sub_ps(d, c)));
+                _mm_storeu_ps(outs[f], _mm_add_ps(top, _mm_mul_ps(fy, _mm_sub_ps(bottom, top))));
+            }
+        }
+#endif
+        for (; gx < GAS_WIDTH; gx++)
+        {
+            float x = (float)gx - u_in[gx]*back;
+            float y = (float)gy - v_in[gx]*back;
+            x = floatmin(floatmax(x, 0.0f), (float)(GAS_WIDTH - 1));
+            y = floatmin(floatmax(y, 0.0f), (float)(GAS_HEIGHT - 1));
+            gas.u[gy*GAS_WIDTH + gx] = GasSample(gas.u_prev, x, y);
+            gas.v[gy*GAS_WIDTH + gx] = GasSample(gas.v_prev, x, y);
+        }
+    }
+    // ---Walls---
+    for (int gx=0; gx < GAS_WIDTH; gx++)
+    {
+        gas.v[gx] = floatmax(gas.v[gx], 0.0f);
+        gas.v[(GAS_HEIGHT - 1)*GAS_WIDTH + gx] = floatmin(gas.v[(GAS_HEIGHT - 1)*GAS_WIDTH + gx], 0.0f);
+    }
+    for (int gy=0; gy < GAS_HEIGHT; gy++)
+    {
+        gas.u[gy*GAS_WIDTH] = floatmax(gas.u[gy*GAS_WIDTH], 0.0f);
+        gas.u[gy*GAS_WIDTH + GAS_WIDTH - 1] = floatmin(gas.u[gy*GAS_WIDTH + GAS_WIDTH - 1], 0.0f);
+    }
+}
+
+/**
+ *  \brief true with probability |speed| (speed in cells per tick).
+ */
+inline internal bool GasChance(float speed, u32 *rng)
+{
+    float p = (speed < 0) ? -speed : speed;
+    return (float)(XorShift32(rng) & 0xFFFF) < p * 65536.0f;
+}
+
+/**
+ *  \brief A gas cell can go to (x,y): empty now and in NEXT.
+ */
+inline internal bool GasCanEnter(int x, int y, u32 *screen_pixels_prev, u32 *screen_pixels_next)
+{
+    return (ColorAt(x, y, screen_pixels_prev) == NOTHING_COLOR)
+        && (ColorAt(x, y, screen_pixels_next) == NOTHING_COLOR);
+}
+
+// ----------------
+// | Reaction lib |
+// ----------------
+
+/** Chemistry
+ *
+ * What happens when two materials touch is data, not code: a table
+ * keyed by (material, neighbor) gives what each becomes and the
+ * chance per tick. Empty space is a neighbor too (REACT_EMPTY), so
+ * fire can burn out into smoke.
+ *
+ * Only materials that appear first in some rule are reactive. The
+ * simulation lists where reactive cells land in NEXT, each chunk row
+ * in its own part of the list, so the inert majority costs nothing.
+ * After the simulation, ReactionsRun visits just the listed cells.
+ * A cell tries at most one reaction per tick: with the first of its
+ * four neighbors in NEXT (in random order) that it has a rule for,
+ * one XorShift32 draw against the rule's precomputed u32 threshold
+ * decides it. So a rule's chance is per tick, however many such
+ * neighbors there are.
+ *
+ * ReactionsRun runs on the main thread in list order with its own
+ * rng, so the result does not depend on the worker count.
+ */
+#define REACT_EMPTY NTYPES // the neighbor is empty space
+#define NREACTANTS (NTYPES + 1)
+
+typedef struct
+{
+    u8 a;          // this material...
+    u8 b;          // ...next to this one (or REACT_EMPTY)...
+    u8 a_becomes;  // ...turns into this (or REACT_EMPTY)...
+    u8 b_becomes;  // ...and turns it into this...
+    float chance;  // ...with this chance per tick
+} reaction_rule_t;
+
+// chance: per tick, for a cell with just this kind of neighbor to react with
+static const reaction_rule_t reaction_rules[] = {
+    {FIRE, WATER,       REACT_EMPTY, STEAM, 0.5f},  // put out, and the water boils
+    {FIRE, SLIME,       FIRE,        FIRE,  0.05f}, // slime burns
+    {FIRE, REACT_EMPTY, SMOKE,       REACT_EMPTY, 0.02f}, // burns out
+};
+
+typedef struct
+{
+    u32 threshold;  // react if XorShift32() < threshold; 0: never
+    u8 a_becomes;
+    u8 b_becomes;
+} reaction_t;
+
+typedef struct
+{
+    reaction_t table[NTYPES][NREACTANTS];
+    bool reactive[NTYPES];
+    int *cells;              // CHUNK_SIZE*SCREEN_WIDTH per chunk row
+    int count[NCHUNK_ROWS];  // listed cells per chunk row, this tick
+} reactions_t;
+
+reactions_t reactions;
+
+internal void ReactionsInit(arena_t *arena)
+{
+    memset(reactions.table, 0, sizeof(reactions.table));
+    memset(reactions.reactive, 0, sizeof(reactions.reactive));
+    for (int r=0; r < (int)(sizeof(reaction_rules)/sizeof(reaction_rules[0])); r++)
+    {
+        const reaction_rule_t *rule = &reaction_rules[r];
+        reaction_t *reaction = &reactions.table[rule->a][rule->b];
+        reaction->threshold = (u32)((double)rule->chance * 4294967295.0);
+        reaction->a_becomes = rule->a_becomes;
+        reaction->b_becomes = rule->b_becomes;
+        reactions.reactive[rule->a] = true;
+    }
+    reactions.cells = (int*) ArenaGrid(arena, NCHUNK_ROWS * CHUNK_SIZE * SCREEN_WIDTH, sizeof(int));
+    memset(reactions.count, 0, sizeof(reactions.count));
+}
+
+/**
+ *  \brief A reactive particle landed at (x,y) in NEXT: list it.
+ *
+ *  Call from the chunk row that simulates row x.
+ */
+inline internal void ReactionsList(int chunk_row, int x, int y)
+{
+    reactions.cells[chunk_row*CHUNK_SIZE*SCREEN_WIDTH + reactions.count[chunk_row]++] = x*SCREEN_WIDTH + y;
+}
+
+/**
+ *  \brief Which reactant has this color.
+ *
+ *  \return particle type, REACT_EMPTY, or -1 (out of bounds, cursor)
+ */
+inline internal int ReactantOf(u32 color)
+{
+    if (color == NOTHING_COLOR) return REACT_EMPTY;
+    if (color == BRICK_COLOR) return BRICK;
+    return ParticleOf(color);
+}
+
+/**
+ *  \brief Put reactant type at (x,y), at rest, counted and dirty.
+ */
+internal void ReactionsPut(int x, int y, int type, u32 *rng,
+        u32 *screen_pixels, momentum_t *momentum, look_t *looks)
+{
+    static const u8 material_of[NREACTANTS] = {
+        LOOK_SAND, LOOK_SLIME, LOOK_WATER, LOOK_BRICK, LOOK_SMOKE, LOOK_STEAM, LOOK_FIRE, LOOK_NOTHING
+    };
+    u32 color = (type == REACT_EMPTY) ? NOTHING_COLOR : colors[type];
+    momentum_t still = {0, 0};
+    PopulationAdd(x, ColorAt(x, y, screen_pixels), -1);
+    PopulationAdd(x, color, 1);
+    ColorSetUnsafe(x, y, color, screen_pixels);
+    MomentumSetUnsafe(x, y, still, momentum);
+    u8 shade = (type == REACT_EMPTY) ? 0 : (u8)(XorShift32(rng) % NSHADES);
+    LookSetUnsafe(x, y, LOOK(material_of[type], shade), looks);
+    MarkDirty(x, y);
+    population.chunk_active[(x/CHUNK_SIZE)*NCHUNK_COLS + y/CHUNK_SIZE]++;
+}
+
+/**
+ *  \brief React the listed cells with their neighbors, in NEXT.
+ */
+internal void ReactionsRun(u32 seed,
+        u32 *screen_pixels, momentum_t *momentum, look_t *looks)
+{
+    const int neighbors[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+    u32 rng = seed ^ 0x9E3779B9;
+    if (rng == 0) rng = 1;
+    for (int chunk_row=0; chunk_row < NCHUNK_ROWS; chunk_row++)
+    {
+        const int *cells = &reactions.cells[chunk_row*CHUNK_SIZE*SCREEN_WIDTH];
+        for (int k=0; k < reactions.count[chunk_row]; k++)
+        {
+            int x = cells[k] / SCREEN_WIDTH;
+            int y = cells[k] % SCREEN_WIDTH;
+            int a = ReactantOf(ColorAt(x, y, screen_pixels));
+            // Overwritten, or already reacted away.
+            if ((a < 0) || (a == REACT_EMPTY) || !reactions.reactive[a]) continue;
+            int first = (int)(XorShift32(&rng) & 3); // no favorite side
+            for (int n=0; n < 4; n++)
+            {
+                int nx = x + neighbors[(first + n) & 3][0];
+                int ny = y + neighbors[(first + n) & 3][1];
+                int b = ReactantOf(ColorAt(nx, ny, screen_pixels));
+                if (b < 0) continue;
+                const reaction_t *reaction = &reactions.table[a][b];
+                if (reaction->threshold == 0) continue;
+                // One draw per cell per tick, see the table.
+                if (XorShift32(&rng) < reaction->threshold)
+                {
+                    if (reaction->b_becomes != b) ReactionsPut(nx, ny, reaction->b_becomes, &rng, screen_pixels, momentum, looks);
+                    if (reaction->a_becomes != a) ReactionsPut(x, y, reaction->a_becomes, &rng, screen_pixels, momentum, looks);
+                }
+                break;
+            }
+        }
+    }
+}
+
+/** Density
+ *
+ * A particle sinks through a lighter fluid below it, or diagonally
+ * below if something is right below, by trading places with it.
+ * Both land in NEXT in the same step, and the fluid is marked moved
+ * so its own turn this tick is skipped: nothing is overwritten and
+ * nothing waits a frame.
+ *
+ * The fluid's turn must still be ahead. So a swap never crosses
+ * into a chunk row that already ran this tick (see DrawParticles).
+ */
+u8 *sim_moved; // SCREEN_WIDTH x SCREEN_HEIGHT, cleared every tick
+
+internal void DensityInit(arena_t *arena)
+{
+    sim_moved = (u8*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u8));
+}
+
+/**
+ *  \return how heavy a particle is, or 0 for what never sinks
+ *  (nothing, brick, me)
+ */
+inline internal int DensityOf(u32 color)
+{
+    switch (color)
+    {
+        case SAND_COLOR:  return 4;
+        case SLIME_COLOR: return 3;
+        case WATER_COLOR: return 2;
+        case SMOKE_COLOR: return 1;
+        case STEAM_COLOR: return 1;
+        default:          return 0;
+    }
+}
+
+inline internal bool CanSinkInto(u32 color, u32 color_other)
+{
+    bool fluid = (color_other == WATER_COLOR) || (color_other == SLIME_COLOR)
+              || (color_other == SMOKE_COLOR) || (color_other == STEAM_COLOR);
+    return fluid && (DensityOf(color) > DensityOf(color_other));
+}
+
+typedef struct
+{
+    u32 *screen_pixels_prev;
+    u32 *screen_pixels_next;
+    momentum_t *momentum_prev;
+    momentum_t *momentum_next;
+    const look_t *looks_prev;
+    look_t *looks_next;
+    u8 *moved;  // see Density
+    u32 seed;   // random, once per tick
+    int first;  // parity that runs first this tick
+    int parity; // 0: even chunk rows, 1: odd chunk rows
+} sim_bands_t;
+
+// Chance that resting slime moves, in 1/2^BERNOULLI_BITS: 22/1024 is about 1/47.
+#define SLIME_MOVE_CHANCE 22
+
+/**
+ *  \brief Job: draw chunk row 2*i + parity of NEXT based on PREV
+ *
+ *  A particle's look moves with it.
+ */
+internal void SimulateBand(void *data, int i)
+{
+    const sim_bands_t *bands = (const sim_bands_t*)data;
+    u32 *screen_pixels_prev = bands->screen_pixels_prev;
+    u32 *screen_pixels_next = bands->screen_pixels_next;
+    momentum_t *momentum_prev = bands->momentum_prev;
+    momentum_t *momentum_next = bands->momentum_next;
+    const look_t *looks_prev = bands->looks_prev;
+    look_t *looks_next = bands->looks_next;
+    u8 *moved = bands->moved;
+    int chunk_row = 2*i + bands->parity;
+    // Same numbers for this band no matter which worker runs it.
+    u32 rng = (bands->seed ^ ((u32)(chunk_row + 1) * 0x9E3779B9u)) | 1;
+    u64 t_chunk = TraceBegin();
+    const bool timing = heatmap.on;
+    u64 lap = 0;
+    int row_end = intmin((chunk_row+1)*CHUNK_SIZE, SCREEN_HEIGHT);
+    // May a particle in the last row swap into the next chunk row?
+    bool next_band_ahead = (bands->parity == bands->first);
+    // May gas in the first row rise into the chunk row above?
+    bool band_above_done = (bands->parity != bands->first);
+    int row_start = chunk_row*CHUNK_SIZE;
+    // Which resting slime moves, 32 columns to a word. A word is
+    // made for the row in slime_moves_row when its first resting
+    // slime asks, so columns without slime draw nothing.
+    u32 slime_moves[(SCREEN_WIDTH + 31)/32];
+    int slime_moves_row[(SCREEN_WIDTH + 31)/32];
+    for (int w=0; w < (SCREEN_WIDTH + 31)/32; w++) slime_moves_row[w] = -1;
+    for (int row=row_start; row < row_end; row++)
+    {
+        for (int col=0; col < SCREEN_WIDTH; col++)
+        {
+            if (timing && ((col % CHUNK_SIZE) == 0)) HeatmapLap(&lap, row, col);
+            int cell = row*SCREEN_WIDTH + col;
+            if (moved[cell]) continue; // swapped up already, see Density
+            /* int dy=0; // dy is 0, +1 or -1 */
+            /* int dx=0; // dx is 0, +1 or -1 */
+            momentum_t momentum = MomentumAt(row, col, momentum_prev);
+            /* momentum.dx = 0; */
+            momentum.dy = 0;
+            u32 color             = ColorAt(row,   col,   screen_pixels_prev);
+            look_t look           = looks_prev[row*SCREEN_WIDTH+col];
+            u32 color_below       = ColorAt(row+1, col,   screen_pixels_prev);
+            u32 color_below_right = ColorAt(row+1, col+1, screen_pixels_prev);
+            u32 color_below_left  = ColorAt(row+1, col-1, screen_pixels_prev);
+            u32 color_right       = ColorAt(row,   col+1, screen_pixels_prev);
+            u32 color_left        = ColorAt(row,   col-1, screen_pixels_prev);
+            // For WATER, also need to look at color in NEXT frame
+            u32 color_next        = ColorAt(row,   col,   screen_pixels_next);
+            u32 color_below_next  = ColorAt(row+1, col,   screen_pixels_next);
+            u32 color_right_next  = ColorAt(row,   col+1, screen_pixels_next);
+            u32 color_left_next   = ColorAt(row,   col-1, screen_pixels_next);
+
+            // ---Sink through a lighter fluid (see Density)---
+            if ((DensityOf(color) > 0) && ((row + 1 < row_end) || next_band_ahead))
+            {
+                int dy = 2; // 2: no swap
+                if (CanSinkInto(color, color_below) && !moved[cell + SCREEN_WIDTH])
+                {
+                    dy = 0;
+                }
+                else if (color_below != NOTHING_COLOR)
+                {
+                    bool left  = CanSinkInto(color, color_below_left)  && !moved[cell + SCREEN_WIDTH - 1];
+                    bool right = CanSinkInto(color, color_below_right) && !moved[cell + SCREEN_WIDTH + 1];
+                    if (left && right) dy = (XorShift32(&rng) & 1) ? 1 : -1;
+                    else if (left)     dy = -1;
+                    else if (right)    dy = 1;
+                }
+                int j = cell + SCREEN_WIDTH + dy; // the fluid
+                // Both places must still be empty in NEXT: a swap never overwrites.
+                if (   (dy != 2)
+                    && (screen_pixels_next[cell] == NOTHING_COLOR)
+                    && (screen_pixels_next[j] == NOTHING_COLOR))
+                {
+                    u32 fluid = screen_pixels_prev[j];
+                    momentum_t fluid_momentum = {0, momentum_prev[j].dy}; // pushed up
+                    momentum_t sinking = {1, (i16)dy};
+                    if (fluid == WATER_COLOR) look = WITH_FILM(look, LOOK(LOOK_WET, 0));
+                    ColorSetUnsafe(row, col, fluid, screen_pixels_next);
+                    MomentumSetUnsafe(row, col, fluid_momentum, momentum_next);
+                    LookSetUnsafe(row, col, looks_prev[j], looks_next);
+                    ColorSetUnsafe(row+1, col+dy, color, screen_pixels_next);
+                    MomentumSetUnsafe(row+1, col+dy, sinking, momentum_next);
+                    LookSetUnsafe(row+1, col+dy, look, looks_next);
+                    moved[j] = 1;
+                    MarkMoved(row, col, sinking);
+                    // Two particles moved; rows and totals do not change.
+                    population.chunk_active[(row/CHUNK_SIZE)*NCHUNK_COLS + col/CHUNK_SIZE] += 2;
+                    continue;
+                }
+            }
+
+            switch (color)
+            {
+
+                case SAND_COLOR:
+                    // Fall down if nothing is below.
+                    if (color_below == NOTHING_COLOR)
+                    {
+                        momentum.dx = 1;
+                        momentum.dy = 0;
+                    }
+                    // Stop falling straight down if SAND or BRICK is below.
+                    if (
+                            (color_below == SAND_COLOR)
+                         || (color_below == BRICK_COLOR)
+                       )
+                    {
+                        // If nothing on either side, pick a side at RANDOM:
+                        if (
+                               (color_below_right == NOTHING_COLOR)
+                            && (color_below_left  == NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dx = 1;
+                            // Pick a random left (-1) or right (+1)
+                            momentum.dy = (XorShift32(&rng) & 1) ? 1 : -1;
+                        }
+                        // If nothing on left only, fall to the left:
+                        if (
+                               (color_below_right != NOTHING_COLOR)
+                            && (color_below_left  == NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dx = 1;
+                            momentum.dy = -1;
+                        }
+                        // If nothing on right only, fall to the right:
+                        if (
+                               (color_below_right == NOTHING_COLOR)
+                            && (color_below_left  != NOTHING_COLOR)
+                            )
+                        {
+                            momentum.dx = 1;
+                            momentum.dy = 1;
+                        }
+                        // If something on both sides, don't fall.
+                        if (
+                               (color_below_right != NOTHING_COLOR)
+                            && (color_below_left  != NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dx = 0;
+                            momentum.dy = 0;
+                        }
+                    }
+                    // Temporary fix: stop falling no matter what is below.
+                    else if (color_below != NOTHING_COLOR)
+                    {
+                        momentum.dx=0;
+                    }
+                    // Sand touching water gets wet, and stays wet.
+                    if (
+                            (color_below == WATER_COLOR)
+                         || (color_left  == WATER_COLOR)
+                         || (color_right == WATER_COLOR)
+                       )
+                    {
+                        look_t wet = WITH_FILM(look, LOOK(LOOK_WET, 0));
+                        if (wet != look) MarkDirty(row, col); // even if it does not move
+                        look = wet;
+                    }
+                    MarkMoved(row, col, momentum);
+                    CountMoved(row, col, momentum, screen_pixels_next);
+                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
+                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
+                    LookSetUnsafe(row+momentum.dx, col+momentum.dy, look, looks_next);
+                    break;
+
+                case SLIME_COLOR:
+                    // Fall down if nothing is below AND nothing
+                    // will be below.
+                    if (
+                            (color_below == NOTHING_COLOR)
+                         && (color_below_next == NOTHING_COLOR)
+                       )
+                    {
+                        momentum.dx = 1;
+                        /* dy = 0; */
+                    }
+                    // Stop falling if ANYTHING is below.
+                    else
+                    {
+                        momentum.dx = 0;
+
+                        // Make SLIME sticky!
+                        // Give SLIME about a 1 out of 47 chance of moving.
+                        if (slime_moves_row[col >> 5] != row)
+                        {
+                            slime_moves[col >> 5] = BernoulliWord(SLIME_MOVE_CHANCE, &rng);
+                            slime_moves_row[col >> 5] = row;
+                        }
+                        bool is_moving = MaskBit(slime_moves, col);
+
+                        if (is_moving)
+                        {
+
+                            /* dx = 0; */
+                            // If nothing on either side, pick a side at RANDOM:
+                            if (
+                                    (color_right      == NOTHING_COLOR)
+                                 && (color_right_next == NOTHING_COLOR)
+                                 && (color_left       == NOTHING_COLOR)
+                                 && (color_left_next  == NOTHING_COLOR)
+                               )
+                            {
+                                momentum.dy = (XorShift32(&rng) & 1) ? 1 : -1;
+                            }
+                            // If nothing on left only, flow left:
+                            else if (
+                                   (color_right      != NOTHING_COLOR)
+                                && (color_left       == NOTHING_COLOR)
+                                && (color_left_next  == NOTHING_COLOR)
+                               )
+                            {
+                                momentum.dy = -1;
+                            }
+                            // If nothing on right only, flow right:
+                            else if (
+                                   (color_right      == NOTHING_COLOR)
+                                && (color_right_next == NOTHING_COLOR)
+                                && (color_left       != NOTHING_COLOR)
+                               )
+                            {
+                                momentum.dy = 1;
+                            }
+                        }
+                    }
+                    MarkMoved(row, col, momentum);
+                    CountMoved(row, col, momentum, screen_pixels_next);
+                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
+                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
+                    LookSetUnsafe(row+momentum.dx, col+momentum.dy, look, looks_next);
+                    break;
+
+                case WATER_COLOR:
+                    // Fall down if nothing is below AND nothing
+                    // will be below.
+                    if (
+                            (color_below == NOTHING_COLOR)
+                         && (color_below_next == NOTHING_COLOR)
+                       )
+                    {
+                        momentum.dx = 1;
+                        /* dy = 0; */
+                    }
+                    // Stop falling if ANYTHING is below.
+                    else
+                    {
+                        momentum.dx = 0;
+                        // If the water has sideways momentum, it
+                        // should keep moving that way, even
+                        // through other water.
+                        if (momentum.dy != 0)
+                        {
+                            // Bump up the water in your path
+                            if (
+                                    (color_right      == WATER_COLOR)
+                                 && (color_right_next == WATER_COLOR)
+                                 && (color_left       == WATER_COLOR)
+                                 && (color_left_next  == WATER_COLOR)
+                               )
+                            {
+                                momentum_t bumped = {1, 0}; // bump up
+                                MomentumSetUnsafe(row, col+momentum.dy, bumped, momentum_next);
+                            }
+                        }
+                        // If dy==0 and nothing on either side, pick a side at RANDOM:
+                        if (
+                                (momentum.dy == 0)
+                             && (color_right      == NOTHING_COLOR)
+                             && (color_right_next == NOTHING_COLOR)
+                             && (color_left       == NOTHING_COLOR)
+                             && (color_left_next  == NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dy = (XorShift32(&rng) & 1) ? 1 : -1;
+                        }
+                        // If nothing on left only, flow left:
+                        else if (
+                               (color_right      != NOTHING_COLOR)
+                            && (color_left       == NOTHING_COLOR)
+                            && (color_left_next  == NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dy = -1;
+                        }
+                        // If nothing on right only, flow right:
+                        else if (
+                               (color_right      == NOTHING_COLOR)
+                            && (color_right_next == NOTHING_COLOR)
+                            && (color_left       != NOTHING_COLOR)
+                           )
+                        {
+                            momentum.dy = 1;
+                        }
+                        // Keep flowing in the same direction
+                        else
+                        {
+                            ; // momentum.dy stays the same
+                        }
+                        //
+                    }
+                    MarkMoved(row, col, momentum);
+                    CountMoved(row, col, momentum, screen_pixels_next);
+                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
+                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
+                    LookSetUnsafe(row+momentum.dx, col+momentum.dy, look, looks_next);
+                    break;
+                case SMOKE_COLOR:
+                case STEAM_COLOR:
+                {
+                    // Thin out: not written to NEXT.
+                    if (XorShift32(&rng) < ((color == STEAM_COLOR) ? GAS_FADE_STEAM : GAS_FADE_SMOKE))
+                    {
+                        population.band_faded[chunk_row][ParticleOf(color)]++;
+                        population.row[row]--;
+                        population.chunk_active[(row/CHUNK_SIZE)*NCHUNK_COLS + col/CHUNK_SIZE]++;
+                        MarkDirty(row, col);
+                        break;
+                    }
+                    // Rise and drift with the gas field (see Gas lib).
+                    int g = (row >> GAS_SHIFT)*GAS_WIDTH + (col >> GAS_SHIFT);
+                    gas.count[g]++;
+                    float u = gas.u[g];
+                    float v = gas.v[g] - ((color == STEAM_COLOR) ? GAS_LIFT_STEAM : GAS_LIFT_SMOKE);
+                    momentum.dx = 0;
+                    momentum.dy = 0;
+                    if (GasChance(v, &rng)) momentum.dx = (v < 0) ? -1 : 1;
+                    if (GasChance(u, &rng)) momentum.dy = (u < 0) ? -1 : 1;
+                    // Not up into a chunk row that has yet to run:
+                    // a particle falling there would land on it.
+                    if ((momentum.dx < 0) && (row == row_start) && !band_above_done) momentum.dx = 0;
+                    // Where it wants to go, else straight, else sideways, else stay.
+                    if (!GasCanEnter(row+momentum.dx, col+momentum.dy, screen_pixels_prev, screen_pixels_next))
+                    {
+                        if (momentum.dx && GasCanEnter(row+momentum.dx, col, screen_pixels_prev, screen_pixels_next))
+                        {
+                            momentum.dy = 0;
+                        }
+                        else if (momentum.dy && GasCanEnter(row, col+momentum.dy, screen_pixels_prev, screen_pixels_next))
+                        {
+                            momentum.dx = 0;
+                        }
+                        else
+                        {
+                            momentum.dx = 0;
+                            momentum.dy = 0;
+                        }
+                    }
+                    MarkMoved(row, col, momentum);
+                    CountMoved(row, col, momentum, screen_pixels_next);
+                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
+                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
+                    LookSetUnsafe(row+momentum.dx, col+momentum.dy, look, looks_next);
+                    break;
+                }
+                case FIRE_COLOR:
+                    // Stays put and flickers; the burning is in ReactionsRun.
+                    momentum.dx = 0;
+                    look = LOOK(LOOK_FIRE, XorShift32(&rng) % NSHADES);
+                    MarkDirty(row, col);
+                    CountMoved(row, col, momentum, screen_pixels_next);
+                    ColorSetUnsafe(row, col, color, screen_pixels_next);
+                    MomentumSetUnsafe(row, col, momentum, momentum_next);
+                    LookSetUnsafe(row, col, look, looks_next);
+                    ReactionsList(chunk_row, row, col);
+                    break;
+                case BRICK_COLOR:
+                    break;
+                case NOTHING_COLOR:
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (timing) HeatmapLap(&lap, row, SCREEN_WIDTH);
+    }
+    TraceEnd("chunk row", "sim", t_chunk, chunk_row);
+}
+
+/**
+ *  \brief Draw particles in NEXT based on PREV
+ *
+ *  Chunk rows are jobs. A particle in the last row of a chunk row
+ *  can land in the first row of the next chunk row, so two chunk
+ *  rows next to each other never run at the same time: all even
+ *  chunk rows, then all odd ones, or the other way around. Which
+ *  go first is picked at random every tick, so a particle at the
+ *  bottom of a chunk row is not always kept from sinking into the
+ *  next. Each chunk row has its own random numbers, seeded from
+ *  rand() once per tick, so a run does not depend on the number of
+ *  threads.
+ */
+internal void DrawParticles(
+        u32 *screen_pixels_prev, u32 *screen_pixels_next,
+        momentum_t *momentum_prev, momentum_t *momentum_next,
+        const look_t *looks_prev, look_t *looks_next
+        )
+{
+    sim_bands_t bands = {
+        screen_pixels_prev, screen_pixels_next,
+        momentum_prev, momentum_next,
+        looks_prev, looks_next,
+        sim_moved, 0, 0, 0
+    };
+    // Two rand() calls: RAND_MAX can be as small as 32767 (MinGW).
+    bands.seed = ((u32)rand() << 16) ^ (u32)rand();
+    bands.first = (int)(bands.seed & 1);
+    memset(sim_moved, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u8));
+    // ---Gas field: at a lower rate, and only with gas about---
+    if ((population.material[SMOKE] + population.material[STEAM]) > 0)
+    {
+        if ((++gas.tick % GAS_STEP_TICKS) == 0)
+        {
+            u64 t_gas = TraceBegin();
+            GasStep(bands.seed);
+            TraceEnd("gas step", "sim", t_gas, -1);
+        }
+    }
+    memset(gas.count, 0, GAS_WIDTH * GAS_HEIGHT * sizeof(int));
+    memset(population.chunk_active, 0, sizeof(population.chunk_active));
+    memset(population.band_lost, 0, sizeof(population.band_lost));
+    memset(population.band_faded, 0, sizeof(population.band_faded));
+    memset(reactions.count, 0, sizeof(reactions.count));
+    if (heatmap.on) memset(heatmap.chunk_ticks, 0, sizeof(heatmap.chunk_ticks));
+    for (int k=0; k < 2; k++)
+    {
+        bands.parity = bands.first ^ k;
+        SDL_atomic_t counter = {0};
+        JobsFork(&counter, SimulateBand, &bands, (NCHUNK_ROWS + 1 - bands.parity)/2);
+        JobsJoin(&counter);
+    }
+    for (int type=0; type < NTYPES; type++)
+    {
+        int lost = 0;
+        for (int chunk_row=0; chunk_row < NCHUNK_ROWS; chunk_row++) lost += population.band_lost[chunk_row][type];
+        population.lost[type] = lost;
+        population.material[type] -= lost;
+        population.lost_total += lost;
+        for (int chunk_row=0; chunk_row < NCHUNK_ROWS; chunk_row++) population.material[type] -= population.band_faded[chunk_row][type];
+    }
+    u64 t_react = TraceBegin();
+    ReactionsRun(bands.seed, screen_pixels_next, momentum_next, looks_next);
+    TraceEnd("reactions", "sim", t_react, -1);
+}
+
+// ---------------
+// | History lib |
+// ---------------
+
+/** Rewind and undo
+ *
+ * After every tick, History keeps the old contents of just the
+ * chunks that tick changed. Rewinding one tick puts them back. The
+ * history is a ring of ticks (at most HISTORY_TICKS) over a ring of
+ * bytes (at most HISTORY_BYTES). When either is full, the oldest
+ * ticks are dropped. So memory depends on how much changes, not on
+ * world size times history length.
+ *
+ * To know what a tick changed, History keeps its own copy of the
+ * world as of the newest tick. Only dirty chunks are compared with
+ * it. A changed chunk goes into the ring as its old pixels and old
+ * looks. Each is run-length encoded when that is smaller (sand is
+ * one color, but its shades are random).
+ *
+ * Rewind restores pixels and looks. Momentum is not kept: the
+ * particles in a restored chunk start again at rest.
+ */
+#define HISTORY_TICKS 1024        // power of two, about 17 s at 60 fps
+#define HISTORY_BYTES (8u << 20)
+// Worst case for one chunk: header, then raw pixels and looks.
+#define HISTORY_CHUNK_MAX (3 + CHUNK_SIZE*CHUNK_SIZE*(sizeof(u32) + sizeof(look_t)))
+
+// Chunk record flags
+#define HISTORY_PIXELS_RLE 1
+#define HISTORY_LOOKS_RLE  2
+
+typedef struct
+{
+    u32 offset; // into bytes
+    u32 size;
+    u16 nchunks;
+    bool edit;  // a world edit (spawn, brush, erase) happened this tick
+} history_tick_t;
+
+typedef struct
+{
+    u32 *pixels;   // the world as of the newest tick
+    look_t *looks;
+    u8 *bytes;     // HISTORY_BYTES of chunk records
+    history_tick_t ticks[HISTORY_TICKS];
+    int oldest;    // index of the oldest tick in ticks
+    int count;     // ticks in the history
+    u32 write;     // where the next tick's records go in bytes
+    bool edit_pending;
+} history_t;
+
+history_t history;
+
+internal void HistoryAlloc(arena_t *arena)
+{
+    history.pixels = (u32*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
+    history.looks  = (look_t*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(look_t));
+    history.bytes  = (u8*) ArenaGrid(arena, HISTORY_BYTES, 1);
+}
+
+/**
+ *  \brief Forget all history; the world now is where it starts.
+ */
+internal void HistoryReset(const u32 *screen_pixels, const look_t *looks)
+{
+    memcpy(history.pixels, screen_pixels, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32));
+    memcpy(history.looks, looks, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(look_t));
+    history.oldest = 0;
+    history.count = 0;
+    history.write = 0;
+    history.edit_pending = false;
+}
+
+/**
+ *  \brief Bytes of n elements as (u8 run, element) pairs.
+ */
+internal int RleSize(const u8 *src, int n, int elem_size)
+{
+    int size = 0;
+    for (int i=0; i < n; )
+    {
+        int run = 1;
+        while ((i + run < n) && (run < 255)
+               && (memcmp(&src[(i + run)*elem_size], &src[i*elem_size], elem_size) == 0)) run++;
+        size += 1 + elem_size;
+        i += run;
+    }
+    return size;
+}
+
+/**
+ *  \brief Write n elements as RLE (if smaller) or raw.
+ *
+ *  \return bytes written
+ */
+internal int HistoryPack(u8 *dst, const u8 *src, int n, int elem_size, bool *rle)
+{
+    int rle_size = RleSize(src, n, elem_size);
+    *rle = (rle_size < n*elem_size);
+    if (!*rle)
+    {
+        memcpy(dst, src, n*elem_size);
+        return n*elem_size;
+    }
+    u8 *out = dst;
+    for (int i=0; i < n; )
+    {
+        int run = 1;
+        while ((i + run < n) && (run < 255)
+               && (memcmp(&src[(i + run)*elem_size], &src[i*elem_size], elem_size) == 0)) run++;
+        *out++ = (u8)run;
+        memcpy(out, &src[i*elem_size], elem_size);
+        out += elem_size;
+        i += run;
+    }
+    return (int)(out - dst);
+}
+
+/**
+ *  \brief Read back n elements written by HistoryPack.
+ *
+ *  \return bytes read
+ */
+internal int HistoryUnpack(u8 *dst, const u8 *src, int n, int elem_size, bool rle)
+{
+    if (!rle)
+    {
+        memcpy(dst, src, n*elem_size);
+        return n*elem_size;
+    }
+    const u8 *in = src;
+    for (int i=0; i < n; )
+    {
+        int run = *in++;
+        for (int k=0; k < run; k++) memcpy(&dst[(i + k)*elem_size], in, elem_size);
+        in += elem_size;
+        i += run;
+    }
+    return (int)(in - src);
+}
+
+internal bool HistoryOverlaps(const history_tick_t *tick, u32 begin, u32 end)
+{
+    // A tick that changed nothing still holds its place in line.
+    u32 tick_end = tick->offset + ((tick->size > 0) ? tick->size : 1);
+    return (tick->offset < end) && (begin < tick_end);
+}
+
+/**
+ *  \brief Does any tick in the history overlap bytes [begin, end)?
+ */
+internal bool HistoryAnyOverlaps(u32 begin, u32 end)
+{
+    for (int k=0; k < history.count; k++)
+    {
+        if (HistoryOverlaps(&history.ticks[(history.oldest + k) % HISTORY_TICKS], begin, end)) return true;
+    }
+    return false;
+}
+
+internal void HistoryDropOldest(void)
+{
+    history.oldest = (history.oldest + 1) % HISTORY_TICKS;
+    history.count--;
+}
+
+/**
+ *  \brief Remember what this tick changed. Call after DrawParticles.
+ *
+ *  Compares the dirty chunks of the new world with the copy.
+ */
+internal void HistoryRecord(const u32 *screen_pixels, const look_t *looks)
+{
+    int ndirty = 0;
+    for (int chunk=0; chunk < NCHUNKS; chunk++) ndirty += chunk_dirty[chunk] ? 1 : 0;
+    // Room for the worst case, at write or back at the start.
+    u32 worst = (u32)(ndirty * HISTORY_CHUNK_MAX);
+    assert(worst < HISTORY_BYTES);
+    if (history.write + worst >= HISTORY_BYTES)
+    {
+        // Whatever is left of the last lap, past where this lap
+        // ends, is older than anything in this lap: drop it all, or
+        // the ring would have a hole in the middle.
+        u32 lap_end = history.write;
+        history.write = 0;
+        while ((history.count > 0) && (history.ticks[history.oldest].offset >= lap_end)) HistoryDropOldest();
+    }
+    if (history.count == HISTORY_TICKS) HistoryDropOldest();
+    // Oldest first, until nothing live is where this tick goes.
+    while ((history.count > 0) && HistoryAnyOverlaps(history.write, history.write + worst)) HistoryDropOldest();
+
+    history_tick_t *tick = &history.ticks[(history.oldest + history.count) % HISTORY_TICKS];
+    tick->offset = history.write;
+    tick->nchunks = 0;
+    tick->edit = history.edit_pending;
+    history.edit_pending = false;
+    u8 *out = &history.bytes[history.write];
+    u32 old_pixels[CHUNK_SIZE * CHUNK_SIZE];
+    look_t old_looks[CHUNK_SIZE * CHUNK_SIZE];
+    for (int chunk=0; (chunk < NCHUNKS) && (ndirty > 0); chunk++)
+    {
+        if (!chunk_dirty[chunk]) continue;
+        ndirty--;
+        int row0 = (chunk / NCHUNK_COLS)*CHUNK_SIZE;
+        int col0 = (chunk % NCHUNK_COLS)*CHUNK_SIZE;
+        int h = intmin(CHUNK_SIZE, SCREEN_HEIGHT - row0);
+        int w = intmin(CHUNK_SIZE, SCREEN_WIDTH  - col0);
+        bool changed = false;
+        for (int row=0; (row < h) && !changed; row++)
+        {
+            int i = (row0 + row)*SCREEN_WIDTH + col0;
+            changed = (memcmp(&history.pixels[i], &screen_pixels[i], w*sizeof(u32)) != 0)
+                   || (memcmp(&history.looks[i], &looks[i], w*sizeof(look_t)) != 0);
+        }
+        if (!changed) continue;
+        // Keep the old chunk, then bring the copy up to date.
+        for (int row=0; row < h; row++)
+        {
+            int i = (row0 + row)*SCREEN_WIDTH + col0;
+            memcpy(&old_pixels[row*w], &history.pixels[i], w*sizeof(u32));
+            memcpy(&old_looks[row*w],  &history.looks[i],  w*sizeof(look_t));
+            memcpy(&history.pixels[i], &screen_pixels[i], w*sizeof(u32));
+            memcpy(&history.looks[i],  &looks[i],         w*sizeof(look_t));
+        }
+        u8 *header = out;
+        out += 3;
+        bool pixels_rle, looks_rle;
+        out += HistoryPack(out, (const u8*)old_pixels, w*h, sizeof(u32), &pixels_rle);
+        out += HistoryPack(out, (const u8*)old_looks,  w*h, sizeof(look_t), &looks_rle);
+        u16 chunk_u16 = (u16)chunk;
+        memcpy(header, &chunk_u16, sizeof(u16));
+        header[2] = (pixels_rle ? HISTORY_PIXELS_RLE : 0) | (looks_rle ? HISTORY_LOOKS_RLE : 0);
+        tick->nchunks++;
+    }
+    tick->size = (u32)(out - &history.bytes[history.write]);
+    history.write += tick->size;
+    history.count++;
+}
+
+/**
+ *  \brief Undo the newest ticks, at most nticks, into the world.
+ *
+ *  \return ticks undone
+ */
+internal int HistoryRewind(int nticks, u32 *screen_pixels, momentum_t *momentum, look_t *looks)
+{
+    int nundone = 0;
+    u32 old_pixels[CHUNK_SIZE * CHUNK_SIZE];
+    look_t old_looks[CHUNK_SIZE * CHUNK_SIZE];
+    for (; (nundone < nticks) && (history.count > 0); nundone++)
+    {
+        history_tick_t *tick = &history.ticks[(history.oldest + history.count - 1) % HISTORY_TICKS];
+        const u8 *in = &history.bytes[tick->offset];
+        for (int k=0; k < tick->nchunks; k++)
+        {
+            u16 chunk;
+            memcpy(&chunk, in, sizeof(u16));
+            assert(chunk < NCHUNKS);
+            u8 flags = in[2];
+            in += 3;
+            int row0 = (chunk / NCHUNK_COLS)*CHUNK_SIZE;
+            int col0 = (chunk % NCHUNK_COLS)*CHUNK_SIZE;
+            int h = intmin(CHUNK_SIZE, SCREEN_HEIGHT - row0);
+            int w = intmin(CHUNK_SIZE, SCREEN_WIDTH  - col0);
+            in += HistoryUnpack((u8*)old_pixels, in, w*h, sizeof(u32), flags & HISTORY_PIXELS_RLE);
+            in += HistoryUnpack((u8*)old_looks,  in, w*h, sizeof(look_t), flags & HISTORY_LOOKS_RLE);
+            rect_t chunk_rect = {col0, row0, w, h};
+            PopulationRect(chunk_rect, screen_pixels, -1);
+            for (int row=0; row < h; row++)
+            {
+                int i = (row0 + row)*SCREEN_WIDTH + col0;
+                memcpy(&history.pixels[i], &old_pixels[row*w], w*sizeof(u32));
+                memcpy(&history.looks[i],  &old_looks[row*w],  w*sizeof(look_t));
+                memcpy(&screen_pixels[i],  &old_pixels[row*w], w*sizeof(u32));
+                memcpy(&looks[i],          &old_looks[row*w],  w*sizeof(look_t));
+                memset(&momentum[i], 0, w*sizeof(momentum_t));
+            }
+            PopulationRect(chunk_rect, screen_pixels, 1);
+            MarkDirty(row0, col0);
+        }
+        history.write = tick->offset;
+        history.count--;
+    }
+    return nundone;
+}
+
+/**
+ *  \brief Ticks to rewind to undo the newest world edit, or 0 if none.
+ */
+internal int HistoryTicksToUndo(void)
+{
+    for (int k=history.count - 1; k >= 0; k--)
+    {
+        if (history.ticks[(history.oldest + k) % HISTORY_TICKS].edit) return history.count - k;
+    }
+    return 0;
+}
+
+internal void HistoryLog(void)
+{
+    u32 nbytes = 0;
+    for (int k=0; k < history.count; k++) nbytes += history.ticks[(history.oldest + k) % HISTORY_TICKS].size;
+    sprintf(log_msg, "History: %d ticks in %u bytes (%.1f bytes/tick)\n",
+            history.count, nbytes, history.count ? (double)nbytes / history.count : 0.0);
+    log_to_file(log_msg);
+}
+
+// ---------------
+// | Command lib |
+// ---------------
+
+/** World edits as commands
+ *
+ * Input does not touch the world. It pushes small command records
+ * into a ring, and the simulation applies them at the start of a
+ * tick, before DrawParticles. So input and the simulation could be
+ * on different threads.
+ *
+ * The ring is single producer (input), single consumer (simulation)
+ * and lock-free: the producer only writes tail, the consumer only
+ * writes head. A full ring drops the command and counts it.
+ */
+#define COMMAND_RING_SIZE 256 // power of two
+
+enum command_type
+{
+    CMD_SPAWN,    // n particles of a particle_type at random spots
+    CMD_BRUSH,    // fill rect with a particle_type, where it is empty
+    CMD_ERASE,    // empty rect
+    CMD_TELEPORT, // me moves to (and takes the size of) rect
+    CMD_REWIND,   // undo the last n ticks (see History lib)
+    CMD_UNDO      // rewind to before the last spawn, brush or erase
+};
+
+typedef struct
+{
+    u8 type;     // enum command_type
+    u8 particle; // enum particle_type, or ALL_TYPES
+    u16 n;
+    rect_t rect;
+} command_t;
+
+typedef struct
+{
+    command_t commands[COMMAND_RING_SIZE];
+    SDL_atomic_t head; // next to pop, written by the consumer
+    SDL_atomic_t tail; // next to push, written by the producer
+    SDL_atomic_t ndropped;
+} command_ring_t;
+
+command_ring_t command_ring;
+
+/**
+ *  \brief Producer: queue a command.
+ *
+ *  \return false if the ring was full (the command is dropped)
+ */
+internal bool CommandPush(command_ring_t *ring, command_t command)
+{
+    u32 tail = (u32)SDL_AtomicGet(&ring->tail);
+    u32 head = (u32)SDL_AtomicGet(&ring->head);
+    if (tail - head >= COMMAND_RING_SIZE)
+    {
+        SDL_AtomicAdd(&ring->ndropped, 1);
+        return false;
+    }
+    ring->commands[tail & (COMMAND_RING_SIZE - 1)] = command;
+    SDL_MemoryBarrierRelease(); // the record before the new tail
+    SDL_AtomicSet(&ring->tail, (int)(tail + 1));
+    return true;
+}
+
+/**
+ *  \brief Consumer: take the oldest command.
+ *
+ *  \return false if the ring is empty
+ */
+internal bool CommandPop(command_ring_t *ring, command_t *command)
+{
+    u32 head = (u32)SDL_AtomicGet(&ring->head);
+    u32 tail = (u32)SDL_AtomicGet(&ring->tail);
+    if (head == tail) return false;
+    SDL_MemoryBarrierAcquire(); // the new tail before the record
+    *command = ring->commands[head & (COMMAND_RING_SIZE - 1)];
+    SDL_MemoryBarrierRelease(); // done reading before the slot is reused
+    SDL_AtomicSet(&ring->head, (int)(head + 1));
+    return true;
+}
+
+internal void PushSpawn(enum particle_type particle, int n)
+{
+    command_t command = {CMD_SPAWN, (u8)particle, (u16)n, {0, 0, 0, 0}};
+    CommandPush(&command_ring, command);
+}
+
+internal void PushRect(enum command_type type, enum particle_type particle, rect_t rect)
+{
+    command_t command = {(u8)type, (u8)particle, 0, rect};
+    CommandPush(&command_ring, command);
+}
+
+/**
+ *  \brief Clip rect to the world inside the brick border.
+ *
+ *  \return false if nothing is left
+ */
+internal bool ClipToWorld(rect_t *rect)
+{
+    int x0 = intmax(rect->x, 1);
+    int y0 = intmax(rect->y, 1);
+    int x1 = intmin(rect->x + rect->w, SCREEN_WIDTH  - 1);
+    int y1 = intmin(rect->y + rect->h, SCREEN_HEIGHT - 1);
+    if ((x1 <= x0) || (y1 <= y0)) return false;
+    rect->x = x0;
+    rect->y = y0;
+    rect->w = x1 - x0;
+    rect->h = y1 - y0;
+    return true;
+}
+
+/**
+ *  \brief Simulation: apply every queued command to the world (PREV).
+ *
+ *  \param rewound  Set if the world went back in time: hold still
+ *                  this tick instead of simulating.
+ *  \return number of commands applied
+ */
+internal int ApplyCommands(
+        command_ring_t *ring,
+        u32 *screen_pixels, momentum_t *momentum, look_t *looks,
+        rect_t *me, bool *rewound
+        )
+{
+    int napplied = 0;
+    command_t command;
+    while (CommandPop(ring, &command))
+    {
+        napplied++;
+        rect_t rect = command.rect;
+        switch (command.type)
+        {
+            case CMD_SPAWN:
+                InitParticles(screen_pixels, looks, command.n, (enum particle_type)command.particle);
+                history.edit_pending = true;
+                break;
+
+            case CMD_BRUSH:
+            {
+                u32 color = SAND_COLOR;
+                u8 material = LOOK_SAND;
+                if (command.particle == WATER)
+                {
+                    color = WATER_COLOR;
+                    material = LOOK_WATER;
+                }
+                if (command.particle == SLIME)
+                {
+                    color = SLIME_COLOR;
+                    material = LOOK_SLIME;
+                }
+                if (command.particle == SMOKE)
+                {
+                    color = SMOKE_COLOR;
+                    material = LOOK_SMOKE;
+                }
+                if (command.particle == STEAM)
+                {
+                    color = STEAM_COLOR;
+                    material = LOOK_STEAM;
+                }
+                if (command.particle == FIRE)
+                {
+                    color = FIRE_COLOR;
+                    material = LOOK_FIRE;
+                }
+                if (!ClipToWorld(&rect)) break;
+                momentum_t still = {0, 0};
+                for (int row=rect.y; row < rect.y + rect.h; row++)
+                {
+                    for (int col=rect.x; col < rect.x + rect.w; col++)
+                    {
+                        if (ColorAt(row, col, screen_pixels) != NOTHING_COLOR) continue;
+                        ColorSetUnsafe(row, col, color, screen_pixels);
+                        PopulationAdd(row, color, 1);
+                        MomentumSetUnsafe(row, col, still, momentum);
+                        LookSetUnsafe(row, col, LOOK(material, rand()%NSHADES), looks);
+                    }
+                }
+                MarkDirtyRect(rect);
+                history.edit_pending = true;
+                break;
+            }
+
+            case CMD_ERASE:
+                if (!ClipToWorld(&rect)) break;
+                PopulationRect(rect, screen_pixels, -1);
+                FillRect(rect, NOTHING_COLOR, screen_pixels);
+                FillLookRect(rect, LOOK(LOOK_NOTHING, 0), looks);
+                MarkDirtyRect(rect);
+                history.edit_pending = true;
+                break;
+
+            case CMD_TELEPORT:
+                *me = rect;
+                break;
+
+            case CMD_REWIND:
+                if (HistoryRewind(command.n, screen_pixels, momentum, looks) > 0) *rewound = true;
+                break;
+
+            case CMD_UNDO:
+            {
+                int nticks = HistoryTicksToUndo();
+                if (HistoryRewind(nticks, screen_pixels, momentum, looks) > 0) *rewound = true;
+                sprintf(log_msg, "Undo: rewound %d ticks\n", nticks);
+                log_to_file(log_msg);
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+    return napplied;
+}
+
+// --------------
+// | Render lib |
+// --------------
+
+// ---Rendering SDL things---
+// true: the colour pass writes straight into the locked texture.
+// false: write to a buffer, then SDL_UpdateTexture copies it.
+bool render_via_lock = true;
+
+/** Camera
+ *
+ * The camera picks which part of the world is in the view. Only
+ * those cells are coloured and uploaded, so render cost goes with
+ * the window size, not the world size.
+ *
+ * (x, y) is the world cell at the top-left of the view: x is the
+ * COL, y is the ROW, like cursor art. At zoom z, one view pixel is
+ * 2^z x 2^z world cells: one pixel of pyramid level z. View pixels
+ * past the edge of the world are NOTHING_COLOR.
+ */
+#define MAX_ZOOM 3
+
+typedef struct
+{
+    int x;
+    int y;
+    int zoom;
+    bool follow_me; // keep me in the middle of the view
+} camera_t;
+
+/** Redraw the whole view
+ *
+ * chunk_dirty says which world cells changed. Some changes are not
+ * in the world: the camera moved, the compositor turned on, the
+ * background under the simulation changed. For those, the whole
+ * view is redrawn next frame and chunk_dirty is left alone.
+ */
+bool view_redraw_all = true;
+
+internal void RedrawAll(void)
+{
+    view_redraw_all = true;
+}
+
+/**
+ *  \brief floor(v / 2^z) and ceil(v / 2^z), also for negative v.
+ */
+inline internal int FloorShift(int v, int z)
+{
+    return (v >= 0) ? (v >> z) : -((-v + (1 << z) - 1) >> z);
+}
+inline internal int CeilShift(int v, int z)
+{
+    return -FloorShift(-v, z);
+}
+
+/**
+ *  \brief Where the camera can go along one axis.
+ *
+ *  \param pos  Wanted position of the view's first cell
+ *  \param span Number of world cells the view covers
+ *  \param world    Number of world cells
+ */
+internal int CameraClamp(int pos, int span, int world)
+{
+    if (span >= world) return (world - span)/2; // center a small world
+    return intmin(intmax(pos, 0), world - span);
+}
+
+/**
+ *  \brief Follow me (if on) and keep the view on the world.
+ */
+internal void CameraUpdate(camera_t *cam, rect_t me)
+{
+    int span_w = VIEW_WIDTH  << cam->zoom;
+    int span_h = VIEW_HEIGHT << cam->zoom;
+    if (cam->follow_me)
+    {
+        cam->x = me.x + me.w/2 - span_w/2;
+        cam->y = me.y + me.h/2 - span_h/2;
+    }
+    cam->x = CameraClamp(cam->x, span_w, SCREEN_WIDTH);
+    cam->y = CameraClamp(cam->y, span_h, SCREEN_HEIGHT);
+    // Snap to whole level pixels so a view row is a level row.
+    cam->x = FloorShift(cam->x, cam->zoom) * (1 << cam->zoom);
+    cam->y = FloorShift(cam->y, cam->zoom) * (1 << cam->zoom);
+}
+
+/**
+ *  \brief FillRect for VIEW_WIDTH x VIEW_HEIGHT layers.
+ */
+internal void FillViewRect(rect_t rect, u32 pixel_color, u32 *view_pixels)
+{
+    for (int row=0; row < rect.h; row++)
+    {
+        for (int col=0; col < rect.w; col++)
+        {
+            view_pixels[ (row + rect.y)*VIEW_WIDTH + (col + rect.x) ] = pixel_color;
+        }
+    }
+}
+
+/** Mip pyramid
+ *
+ * Level k is the world shrunk 2^k times: each pixel is the average
+ * of a 2x2 block of level k-1. Level 0 is the coloured looks.
+ * Zoomed out views and the minimap read a level instead of the
+ * world, so they cost one read per pixel shown.
+ *
+ * A chunk of the world is a (CHUNK_SIZE >> k) square in level k, so
+ * each level is updated one dirty chunk at a time. PyramidUpdate
+ * has to run after the simulation and before the renderer clears
+ * chunk_dirty.
+ */
+#define PYRAMID_TOP 4 // CHUNK_SIZE >> PYRAMID_TOP is 1: a chunk is one pixel
+#define LEVEL_WIDTH(k)  ((SCREEN_WIDTH  + (1 << (k)) - 1) >> (k))
+#define LEVEL_HEIGHT(k) ((SCREEN_HEIGHT + (1 << (k)) - 1) >> (k))
+
+typedef struct
+{
+    u32 *levels[PYRAMID_TOP + 1]; // levels[0] is NULL: colour looks on the fly
+} pyramid_t;
+
+pyramid_t pyramid;
+
+internal void PyramidInit(arena_t *arena)
+{
+    assert((CHUNK_SIZE >> PYRAMID_TOP) >= 1);
+    assert(MAX_ZOOM <= PYRAMID_TOP);
+    for (int k=1; k <= PYRAMID_TOP; k++)
+    {
+        pyramid.levels[k] = (u32*) ArenaGrid(arena, LEVEL_WIDTH(k) * LEVEL_HEIGHT(k), sizeof(u32));
+    }
+}
+
+/**
+ *  \brief Average the 2x2 block at (row, col) of a w x h image.
+ *
+ *  Colors are weighted by alpha, so empty (transparent) cells do
+ *  not darken the grains next to them. Alpha is the plain average:
+ *  a block that is half sand is half see-through. Blocks hanging
+ *  off the edge of the world average only the cells that exist.
+ */
+inline internal u32 Downsample2x2(const u32 *src, int stride, int w, int h, int row, int col)
+{
+    u32 a_sum = 0, r_sum = 0, g_sum = 0, b_sum = 0;
+    u32 n = 0;
+    for (int dr=0; dr < 2; dr++)
+    {
+        if (row + dr >= h) break;
+        for (int dc=0; dc < 2; dc++)
+        {
+            if (col + dc >= w) break;
+            u32 c = src[(row + dr)*stride + col + dc];
+            u32 a = c >> 24;
+            a_sum += a;
+            r_sum += ((c >> 16) & 0xFF) * a;
+            g_sum += ((c >>  8) & 0xFF) * a;
+            b_sum += ((c >>  0) & 0xFF) * a;
+            n++;
+        }
+    }
+    if (a_sum == 0) return NOTHING_COLOR;
+    return ((a_sum / n) << 24)
+         | ((r_sum / a_sum) << 16)
+         | ((g_sum / a_sum) <<  8)
+         | ((b_sum / a_sum) <<  0);
+}
+
+/**
+ *  \brief Job: rebuild the pyramid under the dirty chunks of a chunk row.
+ *
+ *  A chunk's cells at every level only come from that chunk, so
+ *  chunks do not overlap.
+ */
+internal void PyramidChunkRow(void *data, int chunk_row)
+{
+    const look_t *looks = (const look_t*)data;
+    u32 cells[CHUNK_SIZE * CHUNK_SIZE]; // one chunk of level 0
+    for (int chunk_col=0; chunk_col < NCHUNK_COLS; chunk_col++)
+    {
+        if (!chunk_dirty[chunk_row*NCHUNK_COLS + chunk_col]) continue;
+        // Level 0 only exists as looks: colour this chunk of it.
+        int cells_h = intmin(CHUNK_SIZE, SCREEN_HEIGHT - chunk_row*CHUNK_SIZE);
+        int cells_w = intmin(CHUNK_SIZE, SCREEN_WIDTH  - chunk_col*CHUNK_SIZE);
+        for (int row=0; row < cells_h; row++)
+        {
+            PaletteRow(&cells[row*CHUNK_SIZE],
+                       &looks[(chunk_row*CHUNK_SIZE + row)*SCREEN_WIDTH + chunk_col*CHUNK_SIZE],
+                       cells_w);
+        }
+        for (int k=1; k <= PYRAMID_TOP; k++)
+        {
+            u32 *dst = pyramid.levels[k];
+            int size = CHUNK_SIZE >> k;
+            int row_end = intmin((chunk_row + 1)*size, LEVEL_HEIGHT(k));
+            int col_end = intmin((chunk_col + 1)*size, LEVEL_WIDTH(k));
+            for (int row=chunk_row*size; row < row_end; row++)
+            {
+                for (int col=chunk_col*size; col < col_end; col++)
+                {
+                    if (k == 1)
+                    {
+                        dst[row*LEVEL_WIDTH(k) + col] = Downsample2x2(
+                                cells, CHUNK_SIZE, cells_w, cells_h,
+                                2*(row - chunk_row*size), 2*(col - chunk_col*size));
+                    }
+                    else
+                    {
+                        dst[row*LEVEL_WIDTH(k) + col] = Downsample2x2(
+                                pyramid.levels[k-1], LEVEL_WIDTH(k-1),
+                                LEVEL_WIDTH(k-1), LEVEL_HEIGHT(k-1), 2*row, 2*col);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ *  \brief Rebuild the pyramid under every dirty chunk.
+ *
+ *  \return number of chunks rebuilt
+ */
+internal int PyramidUpdate(const look_t *looks)
+{
+    int nchunks = 0;
+    for (int chunk=0; chunk < NCHUNKS; chunk++) nchunks += chunk_dirty[chunk] ? 1 : 0;
+    if (nchunks == 0) return 0;
+    SDL_atomic_t counter = {0};
+    JobsFork(&counter, PyramidChunkRow, (void*)looks, NCHUNK_ROWS);
+    JobsJoin(&counter);
+    return nchunks;
+}
+
+/** Layers that rarely change
+ *
+ * A layer is a texture plus the CPU-side pixels it is made from.
+ * Whoever writes to the pixels sets `dirty`. UploadLayer only
+ * sends the pixels to the texture if they changed since the last
+ * upload.
+ */
+typedef struct
+{
+    SDL_Texture *texture;
+    u32 *pixels; // VIEW_WIDTH x VIEW_HEIGHT
+    bool dirty;  // pixels changed since the last upload
+} layer_t;
+
+internal void UploadLayer(layer_t *layer)
+{
+    if (!layer->dirty) return;
+    SDL_UpdateTexture(
+            layer->texture, // SDL_Texture *
+            NULL,           // const SDL_Rect * - NULL updates entire texture
+            layer->pixels,  // const void *pixels
+            VIEW_WIDTH * sizeof(u32) // int pitch - n bytes in a row of pixel data
+            );
+    layer->dirty = false;
+}
+
+/** Lighting
+ *
+ * Press `g` for darkness and glowing materials. Light lives on a
+ * coarse grid: one light cell per LIGHT_CELL x LIGHT_CELL world
+ * cells. Each light cell has
+ *      emit:  light its cells give off (slime and the cursor glow)
+ *      block: light its cells soak up (sand and bricks block most)
+ * and light spreads out from the emitters as a flood:
+ *      light = max(emit, max of 4 neighbors - LIGHT_FALLOFF - block)
+ * repeated LIGHT_REACH times, after which any light has faded to 0.
+ * In u8 with saturating subtracts, that is a handful of SSE2
+ * instructions per 16 light cells.
+ *
+ * Light only changes near chunks whose looks changed, so LightUpdate
+ * floods a box around the dirty chunks and marks the chunks whose
+ * light changed dirty for the renderer. The colour pass multiplies
+ * pixels by their light cell.
+ */
+bool lighting_on = false;
+
+#define LIGHT_SHIFT 2 // a light cell is 4x4 world cells
+#define LIGHT_CELL (1 << LIGHT_SHIFT)
+#define LIGHT_WIDTH  ((SCREEN_WIDTH  + LIGHT_CELL - 1) >> LIGHT_SHIFT)
+#define LIGHT_HEIGHT ((SCREEN_HEIGHT + LIGHT_CELL - 1) >> LIGHT_SHIFT)
+// One light cell of zeros all the way around: no bounds checks.
+#define LIGHT_STRIDE (LIGHT_WIDTH + 2)
+#define LIGHT_INDEX(ly, lx) (((ly) + 1)*LIGHT_STRIDE + (lx) + 1)
+#define LIGHT_FALLOFF 24 // light lost per light cell travelled
+#define LIGHT_REACH ((255 + LIGHT_FALLOFF - 1) / LIGHT_FALLOFF) // light cells
+#define LIGHT_AMBIENT 64 // darkest it gets
+
+typedef struct
+{
+    u8 *emit;
+    u8 *block;
+    u8 *light;    // what the colour pass uses
+    u8 *flood[2]; // LightFlood ping-pongs between these
+    bool all;     // recompute everything next update
+    u8 look_emit[256];  // per layer of a look, per world cell
+    u8 look_block[256];
+} light_grid_t;
+
+light_grid_t light_grid;
+
+internal void LightInit(arena_t *arena)
+{
+    int n = LIGHT_STRIDE * (LIGHT_HEIGHT + 2);
+    light_grid.emit     = (u8*) ArenaGrid(arena, n, sizeof(u8));
+    light_grid.block    = (u8*) ArenaGrid(arena, n, sizeof(u8));
+    light_grid.light    = (u8*) ArenaGrid(arena, n, sizeof(u8));
+    light_grid.flood[0] = (u8*) ArenaGrid(arena, n, sizeof(u8));
+    light_grid.flood[1] = (u8*) ArenaGrid(arena, n, sizeof(u8));
+    light_grid.all = true;
+    // A light cell sums 16 world cells.
+    const u8 emit[NLOOK_MATERIALS]  = {0,  0,  0, 48,  0, 255, 0, 0, 0, 160};
+    const u8 block[NLOOK_MATERIALS] = {0, 40, 12, 20, 64,   0, 4, 8, 2,   0};
+    for (int m=0; m < NLOOK_MATERIALS; m++)
+    {
+        for (int shade=0; shade < NSHADES; shade++)
+        {
+            light_grid.look_emit[LOOK(m, shade)]  = emit[m];
+            light_grid.look_block[LOOK(m, shade)] = block[m];
+        }
+    }
+}
+
+/**
+ *  \brief Sum emit and block for the light cells of one chunk.
+ */
+internal void LightSources(const look_t *looks, int chunk_row, int chunk_col)
+{
+    const int per_chunk = CHUNK_SIZE >> LIGHT_SHIFT;
+    int ly_end = intmin((chunk_row + 1)*per_chunk, LIGHT_HEIGHT);
+    int lx_end = intmin((chunk_col + 1)*per_chunk, LIGHT_WIDTH);
+    for (int ly=chunk_row*per_chunk; ly < ly_end; ly++)
+    {
+        for (int lx=chunk_col*per_chunk; lx < lx_end; lx++)
+        {
+            u32 emit = 0;
+            u32 block = 0;
+            int row_end = intmin((ly + 1) << LIGHT_SHIFT, SCREEN_HEIGHT);
+            int col_end = intmin((lx + 1) << LIGHT_SHIFT, SCREEN_WIDTH);
+            for (int row=ly << LIGHT_SHIFT; row < row_end; row++)
+            {
+                for (int col=lx << LIGHT_SHIFT; col < col_end; col++)
+                {
+                    look_t look = looks[row*SCREEN_WIDTH + col];
+                    emit  += light_grid.look_emit[LOOK_BACK(look)]  + light_grid.look_emit[LOOK_FRONT(look)];
+                    block += light_grid.look_block[LOOK_BACK(look)] + light_grid.look_block[LOOK_FRONT(look)];
+                }
+            }
+            light_grid.emit[LIGHT_INDEX(ly, lx)]  = (u8)intmin(emit, 255);
+            light_grid.block[LIGHT_INDEX(ly, lx)] = (u8)intmin(block, 255);
+        }
+    }
+}
+
+/**
+ *  \brief Flood light over light cells [x0,x1) x [y0,y1).
+ *
+ *  Everything outside the box counts as dark, so only cells at
+ *  least LIGHT_REACH inside the box come out right.
+ *
+ *  \return the buffer with the result
+ */
+internal const u8 *LightFlood(int x0, int y0, int x1, int y1)
+{
+    u8 *src = light_grid.flood[0];
+    u8 *dst = light_grid.flood[1];
+    // Dark ring around the box, in both buffers.
+    for (int k=0; k < 2; k++)
+    {
+        u8 *buf = light_grid.flood[k];
+        memset(&buf[LIGHT_INDEX(y0 - 1, x0 - 1)], 0, x1 - x0 + 2);
+        memset(&buf[LIGHT_INDEX(y1,     x0 - 1)], 0, x1 - x0 + 2);
+        for (int ly=y0; ly < y1; ly++)
+        {
+            buf[LIGHT_INDEX(ly, x0 - 1)] = 0;
+            buf[LIGHT_INDEX(ly, x1)] = 0;
+        }
+    }
+    for (int ly=y0; ly < y1; ly++)
+    {
+        memcpy(&src[LIGHT_INDEX(ly, x0)], &light_grid.emit[LIGHT_INDEX(ly, x0)], x1 - x0);
+    }
+    for (int step=0; step < LIGHT_REACH; step++)
+    {
+        for (int ly=y0; ly < y1; ly++)
+        {
+            const u8 *up    = &src[LIGHT_INDEX(ly - 1, 0)];
+            const u8 *mid   = &src[LIGHT_INDEX(ly,     0)];
+            const u8 *down  = &src[LIGHT_INDEX(ly + 1, 0)];
+            const u8 *emit  = &light_grid.emit[LIGHT_INDEX(ly, 0)];
+            const u8 *block = &light_grid.block[LIGHT_INDEX(ly, 0)];
+            u8 *out = &dst[LIGHT_INDEX(ly, 0)];
+            int lx = x0;
+#ifdef __SSE2__
+            const __m128i falloff = _mm_set1_epi8(LIGHT_FALLOFF);
+            for (; lx + 16 <= x1; lx += 16)
+            {
+                __m128i n = _mm_max_epu8(
+                        _mm_max_epu8(_mm_loadu_si128((const __m128i*)&up[lx]),
+                                     _mm_loadu_si128((const __m128i*)&down[lx])),
+                        _mm_max_epu8(_mm_loadu_si128((const __m128i*)&mid[lx - 1]),
+                                     _mm_loadu_si128((const __m128i*)&mid[lx + 1])));
+                n = _mm_subs_epu8(_mm_subs_epu8(n, falloff), _mm_loadu_si128((const __m128i*)&block[lx]));
+                n = _mm_max_epu8(n, _mm_loadu_si128((const __m128i*)&emit[lx]));
+                _mm_storeu_si128((__m128i*)&out[lx], n);
+            }
+#endif
+            for (; lx < x1; lx++)
+            {
+                int n = intmax(intmax(up[lx], down[lx]), intmax(mid[lx - 1], mid[lx + 1]));
+                n = intmax(n - LIGHT_FALLOFF - block[lx], 0);
+                out[lx] = (u8)intmax(n, emit[lx]);
+            }
+        }
+        u8 *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+/**
+ *  \brief Bring the light up to date with the looks.
+ *
+ *  Call before anything clears chunk_dirty.
+ *
+ *  \return number of light cells that changed
+ */
+internal int LightUpdate(const look_t *looks)
+{
+    // Bounding box of the chunks whose sources changed.
+    int chunk_row_first = NCHUNK_ROWS, chunk_row_last = -1;
+    int chunk_col_first = NCHUNK_COLS, chunk_col_last = -1;
+    for (int chunk=0; chunk < NCHUNKS; chunk++)
+    {
+        if (!chunk_dirty[chunk] && !light_grid.all) continue;
+        int chunk_row = chunk / NCHUNK_COLS;
+        int chunk_col = chunk % NCHUNK_COLS;
+        LightSources(looks, chunk_row, chunk_col);
+        chunk_row_first = intmin(chunk_row_first, chunk_row);
+        chunk_row_last  = intmax(chunk_row_last,  chunk_row);
+        chunk_col_first = intmin(chunk_col_first, chunk_col);
+        chunk_col_last  = intmax(chunk_col_last,  chunk_col);
+    }
+    light_grid.all = false;
+    if (chunk_row_last < 0) return 0;
+
+    // Light can change up to LIGHT_REACH away from a changed source,
+    // and depends on sources up to LIGHT_REACH away from there.
+    const int per_chunk = CHUNK_SIZE >> LIGHT_SHIFT;
+    int x0 = intmax(chunk_col_first*per_chunk - LIGHT_REACH, 0);
+    int y0 = intmax(chunk_row_first*per_chunk - LIGHT_REACH, 0);
+    int x1 = intmin((chunk_col_last + 1)*per_chunk + LIGHT_REACH, LIGHT_WIDTH);
+    int y1 = intmin((chunk_row_last + 1)*per_chunk + LIGHT_REACH, LIGHT_HEIGHT);
+    const u8 *flooded = LightFlood(
+            intmax(x0 - LIGHT_REACH, 0), intmax(y0 - LIGHT_REACH, 0),
+            intmin(x1 + LIGHT_REACH, LIGHT_WIDTH), intmin(y1 + LIGHT_REACH, LIGHT_HEIGHT));
+
+    int nchanged = 0;
+    for (int ly=y0; ly < y1; ly++)
+    {
+        for (int lx=x0; lx < x1; lx++)
+        {
+            int i = LIGHT_INDEX(ly, lx);
+            if (flooded[i] == light_grid.light[i]) continue;
+            light_grid.light[i] = flooded[i];
+            MarkDirty(ly << LIGHT_SHIFT, lx << LIGHT_SHIFT);
+            nchanged++;
+        }
+    }
+    return nchanged;
+}
+
+/**
+ *  \brief Light one pixel: multiply it and what is behind it by l/255.
+ *
+ *  The pixel is blended over layers below it, so darkening only its
+ *  color would leave the background bright. Instead, pick the
+ *  color and alpha that, blended over anything, give l/255 of what
+ *  the unlit pixel gives:
+ *      alpha' = 1 - (1 - alpha)*l
+ *      color' = color*alpha*l / alpha'
+ *  Empty cells become black with alpha 1-l.
+ */
+inline internal u32 LightPixel(u32 pixel, u32 l)
+{
+    u32 a = pixel >> 24;
+    u32 out_a = 255 - div255((255 - a)*l);
+    if (out_a == 0) return NOTHING_COLOR;
+    u32 num = a*l;         // color' = color*num / den
+    u32 den = 255*out_a;
+    u32 out = out_a << 24;
+    for (int shift=0; shift < 24; shift += 8)
+    {
+        u32 c = (((pixel >> shift) & 0xFF)*num + den/2) / den;
+        out |= intmin(c, 255) << shift;
+    }
+    return out;
+}
+
+/**
+ *  \brief Light n pixels of one level row (see ColorPass).
+ *
+ *  \param level_row    Row in pyramid level z
+ *  \param level_col    Column in pyramid level z of row[0]
+ *  \param z    Pyramid level
+ */
+internal void LightRow(u32 *row, int n, int level_row, int level_col, int z)
+{
+    const u8 *light_row = &light_grid.light[LIGHT_INDEX((level_row << z) >> LIGHT_SHIFT, 0)];
+    for (int i=0; i < n; i++)
+    {
+        u32 l = intmax(light_row[((level_col + i) << z) >> LIGHT_SHIFT], LIGHT_AMBIENT);
+        row[i] = LightPixel(row[i], l);
+    }
+}
+
+/**
+ *  \brief Colour pass: turn simulation state into texture pixels.
+ *
+ *  At zoom 0, each cell's look goes through the palette. Zoomed
+ *  out, this is a row copy of pyramid level z. With lighting on,
+ *  the row is then multiplied by the light. This is the one place
+ *  simulation state becomes pixels, so this is where any per-pixel
+ *  colour work goes.
+ *
+ *  \param dst  Destination for the top-left pixel of rect, e.g., from SDL_LockTexture
+ *  \param pitch    Bytes per row of dst (can be more than rect.w*4)
+ *  \param looks    Look buffer to display
+ *  \param rect Region of the view to colour
+ *  \param cam  Where the view is in the world
+ */
+internal void ColorPass(u32 *dst, int pitch, const look_t *looks, SDL_Rect rect, const camera_t *cam)
+{
+    const int z = cam->zoom;
+    const int level_w = LEVEL_WIDTH(z);
+    const int level_h = LEVEL_HEIGHT(z);
+    // Columns of rect that land on the world.
+    const int level_col = FloorShift(cam->x, z) + rect.x;
+    const int first = intmin(intmax(-level_col, 0), rect.w);
+    const int last  = intmax(intmin(level_w - level_col, rect.w), first);
+    for (int row=0; row < rect.h; row++)
+    {
+        u32 *dst_row = (u32*)((u8*)dst + row*pitch);
+        int level_row = FloorShift(cam->y, z) + rect.y + row;
+        if ((level_row < 0) || (level_row >= level_h))
+        {
+            for (int col=0; col < rect.w; col++) dst_row[col] = NOTHING_COLOR;
+            continue;
+        }
+        for (int col=0; col < first; col++) dst_row[col] = NOTHING_COLOR;
+        if (z == 0)
+        {
+            PaletteRow(&dst_row[first], &looks[level_row*SCREEN_WIDTH + level_col + first], last - first);
+        }
+        else
+        {
+            const u32 *src_row = &pyramid.levels[z][level_row*level_w];
+            memcpy(&dst_row[first], &src_row[level_col + first], (last - first) * sizeof(u32));
+        }
+        if (lighting_on) LightRow(&dst_row[first], last - first, level_row, level_col + first, z);
+        for (int col=last; col < rect.w; col++) dst_row[col] = NOTHING_COLOR;
+    }
+}
+
+/**
+ *  \brief Map a world rect to the view pixels that show it.
+ *
+ *  \return false if none of it is in the view
+ */
+internal bool ViewRectFromWorld(SDL_Rect world, const camera_t *cam, SDL_Rect *view)
+{
+    const int z = cam->zoom;
+    int x0 = intmax(FloorShift(world.x - cam->x, z), 0);
+    int y0 = intmax(FloorShift(world.y - cam->y, z), 0);
+    int x1 = intmin(CeilShift(world.x + world.w - cam->x, z), VIEW_WIDTH);
+    int y1 = intmin(CeilShift(world.y + world.h - cam->y, z), VIEW_HEIGHT);
+    if ((x1 <= x0) || (y1 <= y0)) return false;
+    view->x = x0;
+    view->y = y0;
+    view->w = x1 - x0;
+    view->h = y1 - y0;
+    return true;
+}
+
+/**
+ *  \brief Turn dirty chunks into view rects and clear the dirty flags.
+ *
+ *  Neighboring dirty chunks in a chunk row merge into one rect.
+ *  Chunks outside the view are cleared and skipped. After
+ *  RedrawAll, this is one rect: the whole view.
+ *
+ *  \param rects    Room for NCHUNKS rects
+ *  \param cam  Where the view is in the world
+ *
+ *  \return number of rects
+ */
+internal int CollectDirtyRects(SDL_Rect *rects, const camera_t *cam)
+{
+    if (view_redraw_all)
+    {
+        memset(chunk_dirty, 0, sizeof(chunk_dirty));
+        view_redraw_all = false;
+        SDL_Rect all = {0, 0, VIEW_WIDTH, VIEW_HEIGHT};
+        rects[0] = all;
+        return 1;
+    }
+    int nrects = 0;
+    for (int chunk_row=0; chunk_row < NCHUNK_ROWS; chunk_row++)
+    {
+        u8 *dirty = &chunk_dirty[chunk_row*NCHUNK_COLS];
+        int chunk_col = 0;
+        while (chunk_col < NCHUNK_COLS)
+        {
+            if (!dirty[chunk_col])
+            {
+                chunk_col++;
+                continue;
+            }
+            int run_start = chunk_col;
+            while ((chunk_col < NCHUNK_COLS) && dirty[chunk_col])
+            {
+                dirty[chunk_col] = 0;
+                chunk_col++;
+            }
+            SDL_Rect world;
+            world.x = run_start*CHUNK_SIZE;
+            world.y = chunk_row*CHUNK_SIZE;
+            world.w = intmin(chunk_col*CHUNK_SIZE, SCREEN_WIDTH) - world.x;
+            world.h = intmin((chunk_row+1)*CHUNK_SIZE, SCREEN_HEIGHT) - world.y;
+            if (ViewRectFromWorld(world, cam, &rects[nrects])) nrects++;
+        }
+    }
+    return nrects;
+}
+
+/** CPU compositor
+ *
+ * The GPU path stacks four blended textures: bgnd, layer_green,
+ * layer_red, screen. With the software renderer, that is four
+ * full-screen alpha-blend passes inside SDL. The CPU compositor
+ * does all the blending in one pass per dirty rect, straight into
+ * one streaming texture.
+ *
+ * The blend is SDL_BLENDMODE_BLEND (see SDL_blendmode.h):
+ *      dstRGB = (srcRGB * srcA) + (dstRGB * (1-srcA))
+ *      dstA = srcA + (dstA * (1-srcA))
+ * in 8-bit integers, rounded to nearest:
+ *      dst = round((src*srcA + dst*(255-srcA)) / 255)
+ * For alpha, src is 255.
+ */
+
+// true: blend all layers on the CPU and upload one texture.
+// Starts on if the renderer is a software renderer.
+bool composite_on_cpu = false;
+
+#define MAX_COMPOSITE_LAYERS 4
+
+typedef struct
+{
+    u32 base; // background color, already blended over the clear color
+    const u32 *layers[MAX_COMPOSITE_LAYERS]; // VIEW_WIDTH x VIEW_HEIGHT, bottom first
+    int nlayers;
+    u32 *scratch; // VIEW_WIDTH x VIEW_HEIGHT, for when locking fails
+} compositor_t;
+
+/**
+ *  \brief Blend all compositor layers for one rect into dst.
+ *
+ *  \param dst  Destination for the top-left pixel of rect
+ *  \param pitch    Bytes per row of dst
+ *  \param rect Region of the view to composite
+ *  \param comp Base color and layers to blend over it
+ */
+internal void CompositeRect(u32 *dst, int pitch, SDL_Rect rect, const compositor_t *comp)
+{
+    for (int row=0; row < rect.h; row++)
+    {
+        u32 *dst_row = (u32*)((u8*)dst + row*pitch);
+        int first = (rect.y + row)*VIEW_WIDTH + rect.x;
+        int col = 0;
+#ifdef __SSE2__
+        const __m128i base = _mm_set1_epi32((int)comp->base);
+        for (; col + 4 <= rect.w; col += 4)
+        {
+            __m128i d = base;
+            for (int k=0; k < comp->nlayers; k++)
+            {
+                __m128i src = _mm_loadu_si128((const __m128i*)&comp->layers[k][first + col]);
+                d = BlendPixels4(src, d);
+            }
+            _mm_storeu_si128((__m128i*)&dst_row[col], d);
+        }
+#endif
+        for (; col < rect.w; col++)
+        {
+            u32 d = comp->base;
+            for (int k=0; k < comp->nlayers; k++)
+            {
+                d = BlendPixel(comp->layers[k][first + col], d);
+            }
+            dst_row[col] = d;
+        }
+    }
+}
+
+/** Render passes as jobs
+ *
+ * Dirty rects never overlap, so every rect is a job: colour it into
+ * view_pixels and, with a compositor, blend it into the scratch.
+ */
+typedef struct
+{
+    const look_t *looks;
+    const camera_t *cam;
+    u32 *view_pixels;
+    const compositor_t *comp; // NULL: colour pass only
+    const SDL_Rect *rects;
+    // PresentToSurface only
+    u8 *surface_pixels;
+    int surface_pitch;
+    int visible_w;
+    int visible_h;
+} render_rects_t;
+
+internal void ColorRectJob(void *data, int i)
+{
+    const render_rects_t *job = (const render_rects_t*)data;
+    SDL_Rect rect = job->rects[i];
+    u64 t0 = TraceBegin();
+    ColorPass(&job->view_pixels[rect.y*VIEW_WIDTH + rect.x], VIEW_WIDTH * sizeof(u32), job->looks, rect, job->cam);
+    if (job->comp)
+    {
+        CompositeRect(&job->comp->scratch[rect.y*VIEW_WIDTH + rect.x], VIEW_WIDTH * sizeof(u32), rect, job->comp);
+    }
+    TraceEnd("colour rect", "render", t0, i);
+}
+
+// Whole-view passes split into bands of CHUNK_SIZE view rows.
+#define NVIEW_BANDS ((VIEW_HEIGHT + CHUNK_SIZE - 1) / CHUNK_SIZE)
+
+internal SDL_Rect ViewBand(int i)
+{
+    SDL_Rect band;
+    band.x = 0;
+    band.y = i*CHUNK_SIZE;
+    band.w = VIEW_WIDTH;
+    band.h = intmin(CHUNK_SIZE, VIEW_HEIGHT - band.y);
+    return band;
+}
+
+/**
+ *  \brief Colour the whole view into view_pixels, a band per job.
+ */
+internal void ColorView(const look_t *looks, const camera_t *cam, u32 *view_pixels)
+{
+    static SDL_Rect bands[NVIEW_BANDS];
+    for (int i=0; i < NVIEW_BANDS; i++) bands[i] = ViewBand(i);
+    render_rects_t job = {looks, cam, view_pixels, NULL, bands, NULL, 0, 0, 0};
+    SDL_atomic_t counter = {0};
+    JobsFork(&counter, ColorRectJob, &job, NVIEW_BANDS);
+    JobsJoin(&counter);
+}
+
+/**
+ *  \brief Check CompositeRect against the blend equation in doubles.
+ *
+ *  \return true if every channel of every pixel matches
+ */
+internal bool CompositorSelfCheck(void)
+{
+    #define CHECK_W 19 // not a multiple of 4: check the scalar tail too
+    #define CHECK_H 3
+    static u32 src[2][VIEW_WIDTH * CHECK_H];
+    u32 out[CHECK_W * CHECK_H];
+    compositor_t comp = {0};
+    comp.base = 0xFF102030;
+    comp.layers[0] = src[0];
+    comp.layers[1] = src[1];
+    comp.nlayers = 2;
+    for (int i=0; i < VIEW_WIDTH * CHECK_H; i++)
+    {
+        src[0][i] = ((u32)rand() << 16) ^ (u32)rand();
+        src[1][i] = ((u32)rand() << 16) ^ (u32)rand();
+    }
+    src[1][0] = 0x00FFFFFF; // fully transparent
+    src[1][1] = 0xFF123456; // fully opaque
+    SDL_Rect rect = {0, 0, CHECK_W, CHECK_H};
+    CompositeRect(out, CHECK_W * sizeof(u32), rect, &comp);
+
+    bool pass = true;
+    for (int row=0; row < CHECK_H; row++)
+    {
+        for (int col=0; col < CHECK_W; col++)
+        {
+            double d[4]; // A, R, G, B
+            for (int c=0; c < 4; c++) d[c] = (comp.base >> (24 - 8*c)) & 0xFF;
+            for (int k=0; k < comp.nlayers; k++)
+            {
+                u32 s = comp.layers[k][row*VIEW_WIDTH + col];
+                double a = (s >> 24) / 255.0;
+                d[0] = (int)(255.0*a + d[0]*(1-a) + 0.5);
+                for (int c=1; c < 4; c++)
+                {
+                    d[c] = (int)(((s >> (24 - 8*c)) & 0xFF)*a + d[c]*(1-a) + 0.5);
+                }
+            }
+            u32 expect = ((u32)d[0] << 24) | ((u32)d[1] << 16) | ((u32)d[2] << 8) | (u32)d[3];
+            if (out[row*CHECK_W + col] != expect) pass = false;
+        }
+    }
+    return pass;
+    #undef CHECK_W
+    #undef CHECK_H
+}
+
+/** Minimap
+ *
+ * Press `m` for a map of the whole world in the top-right corner,
+ * with a frame around what the camera sees. It is the smallest
+ * pyramid level that fits in a quarter of the view, so drawing it
+ * costs its own size, however big the world is.
+ */
+bool show_minimap = false;
+
+#define MINIMAP_MARGIN 2 // view pixels from the corner
+#define MINIMAP_BGND   0xFF101010
+#define MINIMAP_FRAME  0xFFFFFFFF
+
+internal int MinimapLevel(void)
+{
+    for (int k=1; k < PYRAMID_TOP; k++)
+    {
+        if ((LEVEL_WIDTH(k) <= VIEW_WIDTH/4) && (LEVEL_HEIGHT(k) <= VIEW_HEIGHT/4)) return k;
+    }
+    return PYRAMID_TOP;
+}
+
+/**
+ *  \brief Where the minimap goes, in view pixels.
+ */
+internal SDL_Rect MinimapRect(void)
+{
+    int k = MinimapLevel();
+    SDL_Rect rect;
+    rect.w = intmin(LEVEL_WIDTH(k),  VIEW_WIDTH  - 2*MINIMAP_MARGIN);
+    rect.h = intmin(LEVEL_HEIGHT(k), VIEW_HEIGHT - 2*MINIMAP_MARGIN);
+    rect.x = VIEW_WIDTH - MINIMAP_MARGIN - rect.w;
+    rect.y = MINIMAP_MARGIN;
+    return rect;
+}
+
+/**
+ *  \brief Draw the minimap, opaque, into the top-left of dst.
+ *
+ *  \param dst  VIEW_WIDTH pixels per row, room for MinimapRect()
+ *  \param cam  The camera to frame
+ */
+internal void MinimapDraw(u32 *dst, const camera_t *cam)
+{
+    int k = MinimapLevel();
+    SDL_Rect rect = MinimapRect();
+    const u32 *level = pyramid.levels[k];
+    for (int row=0; row < rect.h; row++)
+    {
+        for (int col=0; col < rect.w; col++)
+        {
+            dst[row*VIEW_WIDTH + col] = BlendPixel(level[row*LEVEL_WIDTH(k) + col], MINIMAP_BGND);
+        }
+    }
+    // Frame what the camera sees, clipped to the minimap.
+    int x0 = intmax(FloorShift(cam->x, k), 0);
+    int y0 = intmax(FloorShift(cam->y, k), 0);
+    int x1 = intmin(CeilShift(cam->x + (VIEW_WIDTH  << cam->zoom), k), rect.w) - 1;
+    int y1 = intmin(CeilShift(cam->y + (VIEW_HEIGHT << cam->zoom), k), rect.h) - 1;
+    if ((x0 > x1) || (y0 > y1)) return;
+    for (int col=x0; col <= x1; col++)
+    {
+        dst[y0*VIEW_WIDTH + col] = MINIMAP_FRAME;
+        dst[y1*VIEW_WIDTH + col] = MINIMAP_FRAME;
+    }
+    for (int row=y0; row <= y1; row++)
+    {
+        dst[row*VIEW_WIDTH + x0] = MINIMAP_FRAME;
+        dst[row*VIEW_WIDTH + x1] = MINIMAP_FRAME;
+    }
+}
+
+#define HEATMAP_ASLEEP 0x300000FF
+
+/**
+ *  \brief Draw the activity heatmap (see Heatmap lib) over the view.
+ *
+ *  Call after the simulation and before the renderer clears
+ *  chunk_dirty.
+ *
+ *  \return the costliest chunk, in nanoseconds
+ */
+internal int HeatmapDraw(u32 *dst, const camera_t *cam)
+{
+    memset(dst, 0, VIEW_WIDTH * VIEW_HEIGHT * sizeof(u32));
+    u64 max_ticks = 1;
+    for (int chunk=0; chunk < NCHUNKS; chunk++)
+    {
+        if (heatmap.chunk_ticks[chunk] > max_ticks) max_ticks = heatmap.chunk_ticks[chunk];
+    }
+    const int full = CHUNK_SIZE*CHUNK_SIZE/2; // this many moved is fully opaque
+    for (int chunk=0; chunk < NCHUNKS; chunk++)
+    {
+        int z = cam->zoom;
+        int row0 = (chunk / NCHUNK_COLS)*CHUNK_SIZE;
+        int col0 = (chunk % NCHUNK_COLS)*CHUNK_SIZE;
+        rect_t rect;
+        rect.x = intmax(FloorShift(col0 - cam->x, z), 0);
+        rect.y = intmax(FloorShift(row0 - cam->y, z), 0);
+        rect.w = intmin(CeilShift(intmin(col0 + CHUNK_SIZE, SCREEN_WIDTH)  - cam->x, z), VIEW_WIDTH)  - rect.x;
+        rect.h = intmin(CeilShift(intmin(row0 + CHUNK_SIZE, SCREEN_HEIGHT) - cam->y, z), VIEW_HEIGHT) - rect.y;
+        if ((rect.w <= 0) || (rect.h <= 0)) continue;
+        u32 tint = HEATMAP_ASLEEP;
+        if (chunk_dirty[chunk])
+        {
+            u32 hot = (u32)(255 * heatmap.chunk_ticks[chunk] / max_ticks);
+            u32 alpha = 0x40 + 0xA0 * (u32)intmin(population.chunk_active[chunk], full) / full;
+            tint = (alpha << 24) | (hot << 16) | ((255 - hot) << 8);
+        }
+        FillViewRect(rect, tint, dst);
+    }
+    return (int)(max_ticks * 1000000000ull / SDL_GetPerformanceFrequency());
+}
+
+/**
+ *  \brief The alpha experiment: a green and a red rect, half
+ *  transparent. They stay put on the screen when the camera moves.
+ */
+internal void DrawAlphaExperiment(u32 *layer_green_pixels, u32 *layer_red_pixels)
+{
+    // Put big green rect on left side
+    rect_t green_shape = {
+        (1.0/4.0)*VIEW_WIDTH,  // x top-left
+        (1.0/4.0)*VIEW_HEIGHT, // y top-left
+        (1.0/2.0)*VIEW_WIDTH,  // width
+        (1.0/2.0)*VIEW_HEIGHT, // height
+    };
+    // Offset smaller red rect to the right and down a bit
+    rect_t red_shape = {
+        (1.0/2.0)*VIEW_WIDTH,  // x top-left
+        (1.0/3.0)*VIEW_HEIGHT, // y top-left
+        (1.0/3.0)*VIEW_WIDTH,  // width
+        (1.0/3.0)*VIEW_HEIGHT, // height
+    };
+    memset(layer_green_pixels, 0, VIEW_WIDTH * VIEW_HEIGHT * sizeof(u32));
+    memset(layer_red_pixels, 0, VIEW_WIDTH * VIEW_HEIGHT * sizeof(u32));
+    FillViewRect(green_shape, 0x8000FF00, layer_green_pixels);
+    FillViewRect(red_shape, 0x80FF0000, layer_red_pixels);
+}
+
+/**
+ *  \brief Put the simulation on the screen texture.
+ *
+ *  Only the dirty chunks are uploaded, so upload bandwidth goes
+ *  with how much is moving, not with the screen size.
+ *
+ *  With render_via_lock, each dirty rect is locked and the colour
+ *  pass writes into the memory SDL_LockTexture hands out. That
+ *  skips the extra copy SDL_UpdateTexture makes. Locking requires
+ *  a SDL_TEXTUREACCESS_STREAMING texture. If the lock fails, fall
+ *  back to SDL_UpdateTexture.
+ *
+ *  With a compositor, the colour pass goes to view_pixels and the
+ *  dirty rects get the blend of all the compositor layers instead
+ *  of just the simulation.
+ *
+ *  \param screen   Streaming texture, VIEW_WIDTH x VIEW_HEIGHT
+ *  \param looks    Look buffer to display
+ *  \param cam  Where the view is in the world
+ *  \param view_pixels  VIEW_WIDTH x VIEW_HEIGHT colour pass output
+ *  \param comp NULL, or layers to composite (view_pixels is one of them)
+ *
+ *  \return number of rects uploaded
+ */
+internal int UploadScreen(SDL_Texture *screen, const look_t *looks, const camera_t *cam,
+                          u32 *view_pixels, const compositor_t *comp)
+{
+    static SDL_Rect rects[NCHUNKS];
+    int nrects = CollectDirtyRects(rects, cam);
+    int i = 0;
+    // A texture has one lock at a time: one rect after another.
+    for (; render_via_lock && (i < nrects); i++)
+    {
+        SDL_Rect rect = rects[i];
+        void *locked_pixels;
+        int locked_pitch; // n bytes in a row of texture memory
+        if (SDL_LockTexture(screen, &rect, &locked_pixels, &locked_pitch) == 0)
+        {
+            // Locked memory is write-only: write every pixel in rect.
+            if (comp)
+            {
+                ColorPass(&view_pixels[rect.y*VIEW_WIDTH + rect.x], VIEW_WIDTH * sizeof(u32), looks, rect, cam);
+                CompositeRect((u32*)locked_pixels, locked_pitch, rect, comp);
+            }
+            else
+            {
+                ColorPass((u32*)locked_pixels, locked_pitch, looks, rect, cam);
+            }
+            SDL_UnlockTexture(screen);
+            continue;
+        }
+        sprintf(log_msg, "SDL_LockTexture failed: %s\n\tFalling back to SDL_UpdateTexture.\n", SDL_GetError());
+        log_to_file(log_msg);
+        render_via_lock = false;
+        break;
+    }
+    if (i == nrects) return nrects;
+
+    // Colour (and composite) the rest as jobs, then upload.
+    render_rects_t job = {looks, cam, view_pixels, comp, &rects[i], NULL, 0, 0, 0};
+    SDL_atomic_t counter = {0};
+    JobsFork(&counter, ColorRectJob, &job, nrects - i);
+    JobsJoin(&counter);
+    const u32 *pixels = comp ? comp->scratch : view_pixels;
+    for (; i < nrects; i++)
+    {
+        SDL_Rect rect = rects[i];
+        SDL_UpdateTexture(
+                screen, // SDL_Texture *
+                &rect,  // const SDL_Rect * - region to update
+                &pixels[rect.y*VIEW_WIDTH + rect.x], // const void *pixels
+                VIEW_WIDTH * sizeof(u32) // int pitch - n bytes in a row of pixel data
+                );
+    }
+    return nrects;
+}
+
+
+/** Present straight to the window surface
+ *
+ *      ./falling-something --surface
+ *
+ * Skips SDL_Renderer. The CPU compositor blends the dirty rects,
+ * UpscaleRect blows them up PIXEL_SCALE times into the window
+ * surface, and SDL_UpdateWindowSurfaceRects shows only those
+ * rects. On machines without a GPU, this replaces the software
+ * renderer's generic scaler.
+ *
+ * SDL does not allow a renderer and the window surface on the same
+ * window, so this is picked once, at startup.
+ */
+bool present_to_surface = false;
+
+/**
+ *  \brief Nearest-neighbor upscale a rect by PIXEL_SCALE.
+ *
+ *  Each source pixel is repeated PIXEL_SCALE times along the row,
+ *  then the scaled row is memcpy'd PIXEL_SCALE-1 more times.
+ *
+ *  \param dst  Destination for the top-left pixel of the scaled rect
+ *  \param pitch    Bytes per row of dst
+ *  \param src  VIEW_WIDTH x VIEW_HEIGHT source pixels
+ *  \param rect Region of src to upscale
+ */
+internal void UpscaleRect(u8 *dst, int pitch, const u32 *src, SDL_Rect rect)
+{
+    for (int row=0; row < rect.h; row++)
+    {
+        const u32 *src_row = &src[(rect.y + row)*VIEW_WIDTH + rect.x];
+        u32 *dst_row = (u32*)(dst + row*PIXEL_SCALE*pitch);
+        int col = 0;
+#ifdef __SSE2__
+#if PIXEL_SCALE == 4
+        // 4 pixels in, 16 pixels out: broadcast each 32-bit lane.
+        for (; col + 4 <= rect.w; col += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)&src_row[col]);
+            u32 *out = &dst_row[col*4];
+            _mm_storeu_si128((__m128i*)&out[ 0], _mm_shuffle_epi32(v, 0x00));
+            _mm_storeu_si128((__m128i*)&out[ 4], _mm_shuffle_epi32(v, 0x55));
+            _mm_storeu_si128((__m128i*)&out[ 8], _mm_shuffle_epi32(v, 0xAA));
+            _mm_storeu_si128((__m128i*)&out[12], _mm_shuffle_epi32(v, 0xFF));
+        }
+#elif PIXEL_SCALE == 2
+        // 4 pixels in, 8 pixels out: interleave v with itself.
+        for (; col + 4 <= rect.w; col += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)&src_row[col]);
+            u32 *out = &dst_row[col*2];
+            _mm_storeu_si128((__m128i*)&out[0], _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128((__m128i*)&out[4], _mm_unpackhi_epi32(v, v));
+        }
+#else
+        // Any scale: 4 copies of the pixel per store.
+        for (; col < rect.w; col++)
+        {
+            __m128i v = _mm_set1_epi32((int)src_row[col]);
+            u32 *out = &dst_row[col*PIXEL_SCALE];
+            int k = 0;
+            for (; k + 4 <= PIXEL_SCALE; k += 4) _mm_storeu_si128((__m128i*)&out[k], v);
+            for (; k < PIXEL_SCALE; k++) out[k] = src_row[col];
+        }
+#endif
+#endif
+        for (; col < rect.w; col++)
+        {
+            for (int k=0; k < PIXEL_SCALE; k++) dst_row[col*PIXEL_SCALE + k] = src_row[col];
+        }
+        for (int k=1; k < PIXEL_SCALE; k++)
+        {
+            memcpy(dst + (row*PIXEL_SCALE + k)*pitch, dst_row, rect.w * PIXEL_SCALE * sizeof(u32));
+        }
+    }
+}
+
+/**
+ *  \brief Job: colour, composite and upscale one rect into the surface.
+ */
+internal void SurfaceRectJob(void *data, int i)
+{
+    const render_rects_t *job = (const render_rects_t*)data;
+    ColorRectJob(data, i);
+    SDL_Rect rect = job->rects[i];
+    rect.w = intmin(rect.x + rect.w, job->visible_w) - rect.x;
+    rect.h = intmin(rect.y + rect.h, job->visible_h) - rect.y;
+    if ((rect.w <= 0) || (rect.h <= 0)) return;
+    u8 *dst = job->surface_pixels
+            + rect.y*PIXEL_SCALE*job->surface_pitch
+            + rect.x*PIXEL_SCALE*sizeof(u32);
+    UpscaleRect(dst, job->surface_pitch, job->comp->scratch, rect);
+}
+
+/**
+ *  \brief Composite the dirty rects, upscale them into the window
+ *  surface, and show them.
+ *
+ *  Call SDL_GetWindowSurface every frame: resizing the window
+ *  makes a new surface. A new surface means redraw everything.
+ *
+ *  \param win  Window without a renderer
+ *  \param looks    Look buffer to display
+ *  \param cam  Where the view is in the world
+ *  \param view_pixels  VIEW_WIDTH x VIEW_HEIGHT colour pass output
+ *  \param comp Layers to composite (view_pixels is one of them)
+ *  \param minimap_pixels   NULL, or the minimap to draw on top (see MinimapDraw)
+ *
+ *  \return number of rects presented, or -1 if the surface is unusable
+ */
+internal int PresentToSurface(SDL_Window *win, const look_t *looks, const camera_t *cam,
+                              u32 *view_pixels, const compositor_t *comp, const u32 *minimap_pixels)
+{
+    static SDL_Surface *last_surface = NULL;
+    static int last_w, last_h;
+    static SDL_Rect rects[NCHUNKS];
+    static SDL_Rect scaled_rects[NCHUNKS + 1];
+
+    SDL_Surface *surface = SDL_GetWindowSurface(win);
+    if (!surface) return -1;
+    // Need the same byte order as ARGB8888 (alpha is ignored).
+    if (   (surface->format->BytesPerPixel != 4)
+        || (surface->format->Rmask != 0x00FF0000)
+        || (surface->format->Gmask != 0x0000FF00)
+        || (surface->format->Bmask != 0x000000FF))
+    {
+        sprintf(log_msg, "Window surface is %s, not XRGB8888.\n", SDL_GetPixelFormatName(surface->format->format));
+        log_to_file(log_msg);
+        return -1;
+    }
+    if ((surface != last_surface) || (surface->w != last_w) || (surface->h != last_h))
+    {
+        RedrawAll();
+        last_surface = surface;
+        last_w = surface->w;
+        last_h = surface->h;
+    }
+    // View pixels that fit in the surface (the window can be resized).
+    int visible_w = intmin(VIEW_WIDTH,  surface->w / PIXEL_SCALE);
+    int visible_h = intmin(VIEW_HEIGHT, surface->h / PIXEL_SCALE);
+
+    int nrects = CollectDirtyRects(rects, cam);
+    int nshown = 0;
+    SDL_LockSurface(surface);
+    render_rects_t job = {
+        looks, cam, view_pixels, comp, rects,
+        (u8*)surface->pixels, surface->pitch, visible_w, visible_h
+    };
+    SDL_atomic_t counter = {0};
+    JobsFork(&counter, SurfaceRectJob, &job, nrects);
+    JobsJoin(&counter);
+    for (int i=0; i < nrects; i++)
+    {
+        SDL_Rect rect = rects[i];
+        rect.w = intmin(rect.x + rect.w, visible_w) - rect.x;
+        rect.h = intmin(rect.y + rect.h, visible_h) - rect.y;
+        if ((rect.w <= 0) || (rect.h <= 0)) continue;
+        SDL_Rect *scaled = &scaled_rects[nshown++];
+        scaled->x = rect.x*PIXEL_SCALE;
+        scaled->y = rect.y*PIXEL_SCALE;
+        scaled->w = rect.w*PIXEL_SCALE;
+        scaled->h = rect.h*PIXEL_SCALE;
+    }
+    if (minimap_pixels)
+    {
+        // Dirty rects may have drawn over it: draw it every frame.
+        SDL_Rect rect = MinimapRect();
+        SDL_Rect src = {0, 0, intmin(rect.x + rect.w, visible_w) - rect.x, intmin(rect.y + rect.h, visible_h) - rect.y};
+        if ((src.w > 0) && (src.h > 0))
+        {
+            u8 *dst = (u8*)surface->pixels
+                    + rect.y*PIXEL_SCALE*surface->pitch
+                    + rect.x*PIXEL_SCALE*sizeof(u32);
+            UpscaleRect(dst, surface->pitch, minimap_pixels, src);
+            SDL_Rect *scaled = &scaled_rects[nshown++];
+            scaled->x = rect.x*PIXEL_SCALE;
+            scaled->y = rect.y*PIXEL_SCALE;
+            scaled->w = src.w*PIXEL_SCALE;
+            scaled->h = src.h*PIXEL_SCALE;
+        }
+    }
+    SDL_UnlockSurface(surface);
+    if (nshown > 0) SDL_UpdateWindowSurfaceRects(win, scaled_rects, nshown);
+    return nshown;
+}
+
+// ---------------
+// | Capture lib |
+// ---------------
+
+/** Record frames to disk without slowing down the game
+ *
+ * Press `v` to start recording, `v` again to stop. Each recording
+ * is one Y4M video, capture_NNN.y4m, or with --capture-ppm, a
+ * numbered PPM per frame, capture_NNN_FFFFF.ppm.
+ *
+ * The game loop composites the frame into one of CAPTURE_POOL
+ * preallocated buffers and queues it. A writer thread converts
+ * and writes the queued frames, then puts the buffers back. If
+ * every buffer is still waiting to be written, the frame is
+ * dropped and counted: the game loop never waits for the disk.
+ */
+
+#define CAPTURE_POOL 8
+// Queue entries are buffer indices or one of these:
+#define CAPTURE_END  -1 // close the current recording
+#define CAPTURE_QUIT -2 // writer thread exits
+#define CAPTURE_QUEUE_SIZE (2*CAPTURE_POOL + 2)
+
+typedef struct
+{
+    u32 *buffers[CAPTURE_POOL];
+    int free_list[CAPTURE_POOL]; // buffers the game loop can fill
+    int nfree;
+    int queue[CAPTURE_QUEUE_SIZE]; // waiting for the writer
+    int head;
+    int tail;
+    SDL_mutex *lock;   // guards free_list and queue
+    SDL_sem *nqueued;  // writer sleeps on this
+    SDL_Thread *thread;
+    bool on;           // recording
+    bool ppm;          // PPM sequence instead of Y4M
+    int fps;           // for the Y4M header
+    int session_frames; // frames queued in this recording
+    SDL_atomic_t nwritten;
+    SDL_atomic_t ndropped;
+    int ndropped_total; // every recording, for metrics
+} capture_t;
+
+capture_t capture;
+
+internal void CapturePush(int entry)
+{
+    SDL_LockMutex(capture.lock);
+    capture.queue[capture.tail] = entry;
+    capture.tail = (capture.tail + 1) % CAPTURE_QUEUE_SIZE;
+    SDL_UnlockMutex(capture.lock);
+    SDL_SemPost(capture.nqueued);
+}
+
+/**
+ *  \brief Write one frame as BT.601 Y'CbCr 4:4:4.
+ */
+internal void CaptureWriteY4M(FILE *out, const u32 *pixels, u8 *planes)
+{
+    const int npixels = VIEW_WIDTH * VIEW_HEIGHT;
+    u8 *Y = planes;
+    u8 *Cb = planes + npixels;
+    u8 *Cr = planes + 2*npixels;
+    for (int i=0; i < npixels; i++)
+    {
+        int R = (pixels[i] >> 16) & 0xFF;
+        int G = (pixels[i] >>  8) & 0xFF;
+        int B = (pixels[i] >>  0) & 0xFF;
+        Y[i]  = (u8)((( 66*R + 129*G +  25*B + 128) >> 8) +  16);
+        Cb[i] = (u8)(((-38*R -  74*G + 112*B + 128) >> 8) + 128);
+        Cr[i] = (u8)(((112*R -  94*G -  18*B + 128) >> 8) + 128);
+    }
+    fprintf(out, "FRAME\n");
+    fwrite(planes, 1, 3*npixels, out);
+}
+
+internal void CaptureWritePPM(FILE *out, const u32 *pixels, u8 *rgb)
+{
+    const int npixels = VIEW_WIDTH * VIEW_HEIGHT;
+    for (int i=0; i < npixels; i++)
+    {
+        rgb[3*i + 0] = (pixels[i] >> 16) & 0xFF;
+        rgb[3*i + 1] = (pixels[i] >>  8) & 0xFF;
+        rgb[3*i + 2] = (pixels[i] >>  0) & 0xFF;
+    }
+    fprintf(out, "P6\n%d %d\n255\n", VIEW_WIDTH, VIEW_HEIGHT);
+    fwrite(rgb, 1, 3*npixels, out);
+}
+
+internal int CaptureWriterThread(void *data)
+{
+    (void)data;
+    TraceNameThread("capture writer");
+    // Not log_msg: that belongs to the game loop.
+    char msg[MAX_LOG_MSG];
+    char path[64];
+    u8 *scratch = (u8*) malloc(3 * VIEW_WIDTH * VIEW_HEIGHT);
+    assert(scratch);
+    FILE *out = NULL;      // Y4M file of this recording
+    bool recording = false; // got a frame since the last CAPTURE_END
+    int session = 0;
+    int frame = 0;
+    for (;;)
+    {
+        SDL_SemWait(capture.nqueued);
+        SDL_LockMutex(capture.lock);
+        int entry = capture.queue[capture.head];
+        capture.head = (capture.head + 1) % CAPTURE_QUEUE_SIZE;
+        SDL_UnlockMutex(capture.lock);
+
+        if ((entry == CAPTURE_END) || (entry == CAPTURE_QUIT))
+        {
+            if (recording)
+            {
+                if (out) fclose(out);
+                sprintf(msg, "Capture: wrote %d frames for recording %d\n", frame, session);
+                log_to_file(msg);
+                out = NULL;
+                recording = false;
+            }
+            if (entry == CAPTURE_QUIT) break;
+            continue;
+        }
+
+        u64 t_write = TraceBegin();
+        if (!recording)
+        {
+            recording = true;
+            session++;
+            frame = 0;
+            if (!capture.ppm)
+            {
+                sprintf(path, "capture_%03d.y4m", session);
+                out = fopen(path, "wb");
+                if (out)
+                {
+                    fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", VIEW_WIDTH, VIEW_HEIGHT, capture.fps);
+                }
+            }
+        }
+        if (capture.ppm)
+        {
+            sprintf(path, "capture_%03d_%05d.ppm", session, frame);
+            FILE *ppm = fopen(path, "wb");
+            if (ppm)
+            {
+                CaptureWritePPM(ppm, capture.buffers[entry], scratch);
+                fclose(ppm);
+            }
+        }
+        else if (out)
+        {
+            CaptureWriteY4M(out, capture.buffers[entry], scratch);
+        }
+        frame++;
+        SDL_AtomicAdd(&capture.nwritten, 1);
+        TraceEnd("write frame", "capture", t_write, frame);
+
+        SDL_LockMutex(capture.lock);
+        capture.free_list[capture.nfree++] = entry;
+        SDL_UnlockMutex(capture.lock);
+    }
+    free(scratch);
+    return 0;
+}
+
+internal void CaptureInit(bool ppm, int fps)
+{
+    memset(&capture, 0, sizeof(capture));
+    capture.ppm = ppm;
+    capture.fps = fps;
+    for (int i=0; i < CAPTURE_POOL; i++)
+    {
+        capture.buffers[i] = (u32*) calloc(VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+        assert(capture.buffers[i]);
+        capture.free_list[capture.nfree++] = i;
+    }
+    capture.lock = SDL_CreateMutex();
+    capture.nqueued = SDL_CreateSemaphore(0);
+    assert(capture.lock && capture.nqueued);
+    capture.thread = SDL_CreateThread(CaptureWriterThread, "capture writer", NULL);
+    assert(capture.thread);
+}
+
+internal void CaptureToggle(void)
+{
+    capture.on = !capture.on;
+    if (capture.on)
+    {
+        capture.session_frames = 0;
+        SDL_AtomicSet(&capture.ndropped, 0);
+        sprintf(log_msg, "Capture: recording (%s)\n", capture.ppm ? "PPM" : "Y4M");
+        log_to_file(log_msg);
+    }
+    else
+    {
+        sprintf(log_msg, "Capture: stopped, %d frames queued, %d dropped\n",
+                capture.session_frames, SDL_AtomicGet(&capture.ndropped));
+        log_to_file(log_msg);
+        if (capture.session_frames > 0) CapturePush(CAPTURE_END);
+    }
+}
+
+// Capture jobs: one view band each.
+typedef struct
+{
+    u32 *dst; // VIEW_WIDTH x VIEW_HEIGHT
+    const compositor_t *comp;
+} capture_bands_t;
+
+/**
+ *  \brief Job: composite band i of the view into the capture buffer.
+ */
+internal void CaptureBandJob(void *data, int i)
+{
+    const capture_bands_t *job = (const capture_bands_t*)data;
+    SDL_Rect band = ViewBand(i);
+    CompositeRect(&job->dst[band.y*VIEW_WIDTH], VIEW_WIDTH * sizeof(u32), band, job->comp);
+}
+
+/**
+ *  \brief Queue the composited frame for the writer, or drop it.
+ *
+ *  \param comp Layers that make up the frame (all of them up to date)
+ */
+internal void CaptureFrame(const compositor_t *comp)
+{
+    if (!capture.on) return;
+    int buffer = -1;
+    SDL_LockMutex(capture.lock);
+    if (capture.nfree > 0) buffer = capture.free_list[--capture.nfree];
+    SDL_UnlockMutex(capture.lock);
+    if (buffer < 0)
+    {
+        SDL_AtomicAdd(&capture.ndropped, 1); // writer is behind
+        capture.ndropped_total++;
+        return;
+    }
+    capture_bands_t job = {capture.buffers[buffer], comp};
+    SDL_atomic_t counter = {0};
+    JobsFork(&counter, CaptureBandJob, &job, NVIEW_BANDS);
+    JobsJoin(&counter);
+    capture.session_frames++;
+    CapturePush(buffer);
+}
+
+/**
+ *  \brief Finish writing what is queued and stop the writer thread.
+ */
+internal void CaptureShutdown(void)
+{
+    if (capture.on) CaptureToggle();
+    CapturePush(CAPTURE_QUIT);
+    SDL_WaitThread(capture.thread, NULL);
+}
+
+// ----------------
+// | Frame pacing |
+// ----------------
+
+/** Frame pacer
+ *
+ * Every frame should take 1/fps seconds, however long the work
+ * took. PacerWait sleeps for what is left of the frame budget,
+ * minus a little, then spins on SDL_GetPerformanceCounter for
+ * the last PACER_SPIN_US (SDL_Delay can oversleep by a
+ * millisecond or more).
+ *
+ * With vsync, SDL_RenderPresent already waits for the display, so
+ * PacerWait does not sleep. It only keeps the statistics, and a
+ * frame is missed when it took longer than the display's refresh
+ * (not 1/fps: the display may refresh slower than asked for).
+ *
+ * Every PACER_REPORT_FRAMES frames, log.txt gets the mean frame
+ * time, jitter (standard deviation), worst frame and the number
+ * of missed deadlines.
+ */
+
+#define TARGET_FPS 60
+#define PACER_SPIN_US 500
+#define PACER_REPORT_FRAMES 600
+
+typedef struct
+{
+    u64 freq;     // performance counter ticks per second
+    u64 period;   // ticks per frame
+    u64 refresh;  // ticks per display refresh (vsync only)
+    u64 deadline; // when this frame should end
+    u64 last;     // when the last frame ended
+    bool vsync;   // SDL_RenderPresent waits for us
+    // ---Stats since the last report---
+    int nframes;
+    int nmissed;
+    double sum_ms;
+    double sum_sq_ms;
+    double max_ms;
+} pacer_t;
+
+/**
+ *  \brief Start pacing at fps frames per second.
+ *
+ *  \param refresh_hz  Display refresh rate with vsync, 0 without
+ *                     (or if the display does not say)
+ */
+internal void PacerInit(pacer_t *pacer, int fps, bool vsync, int refresh_hz)
+{
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->freq = SDL_GetPerformanceFrequency();
+    pacer->period = pacer->freq / fps;
+    pacer->refresh = (refresh_hz > 0) ? pacer->freq / refresh_hz : pacer->period;
+    pacer->vsync = vsync;
+    pacer->last = SDL_GetPerformanceCounter();
+    pacer->deadline = pacer->last + pacer->period;
+    if (vsync) sprintf(log_msg, "Frame pacer: vsync, display refreshes at %d Hz\n", refresh_hz);
+    else       sprintf(log_msg, "Frame pacer: %d fps, sleep + spin\n", fps);
+    log_to_file(log_msg);
+}
+
+internal void PacerReport(pacer_t *pacer)
+{
+    double mean = pacer->sum_ms / pacer->nframes;
+    double var = pacer->sum_sq_ms / pacer->nframes - mean*mean;
+    sprintf(log_msg,
+            "Frame pacer: %d frames, mean %.3f ms, jitter %.3f ms, worst %.3f ms, missed %d\n",
+            pacer->nframes, mean, (var > 0) ? SDL_sqrt(var) : 0.0, pacer->max_ms, pacer->nmissed);
+    log_to_file(log_msg);
+    pacer->nframes = 0;
+    pacer->nmissed = 0;
+    pacer->sum_ms = 0;
+    pacer->sum_sq_ms = 0;
+    pacer->max_ms = 0;
+}
+
+/**
+ *  \brief Wait out the rest of this frame. Call once per frame.
+ */
+internal void PacerWait(pacer_t *pacer)
+{
+    u64 now = SDL_GetPerformanceCounter();
+    if (!pacer->vsync)
+    {
+        if (now > pacer->deadline)
         {
-            y = rand() % SCREEN_WIDTH/2 + SCREEN_WIDTH/4;
-            x = rand() % SCREEN_HEIGHT/8;
+            pacer->nmissed++;
         }
-        // Only put new particles in empty space
-        if (ColorAt(x, y, screen_pixels) == NOTHING_COLOR)
+        else
         {
-            // Let SAND be any particles between 1/m and 1/n of screen width
-            if ((type == SAND) || (type == ALL_TYPES))
-            {
-                if (
-                    ((1.0/5.0)*SCREEN_WIDTH < y )
-                    && (y < (3.0/5.0)*SCREEN_WIDTH)
-                   )
-                {
-                    ColorSetUnsafe(x, y, SAND_COLOR, screen_pixels);
-                }
-            }
-            // And let WATER be to the RIGHT of SAND.
-            if ((type == WATER) || (type == ALL_TYPES))
+            u64 spin = pacer->freq * PACER_SPIN_US / 1000000;
+            u64 remaining = pacer->deadline - now;
+            if (remaining > spin)
             {
-                if (
-                    ((2.5/5.0)*SCREEN_WIDTH < y )
-                    && (y < (4.0/5.0)*SCREEN_WIDTH)
-                   )
-                {
-                    ColorSetUnsafe(x, y, WATER_COLOR, screen_pixels);
-                }
+                SDL_Delay((u32)((remaining - spin) * 1000 / pacer->freq));
             }
-            // And let SLIME be to the far RIGHT.
-            if ((type == SLIME) || (type == ALL_TYPES))
+            while ((now = SDL_GetPerformanceCounter()) < pacer->deadline)
             {
-                if (
-                    ((3.5/5.0)*SCREEN_WIDTH < y )
-                    && (y < (5.0/5.0)*SCREEN_WIDTH)
-                   )
-                {
-                    ColorSetUnsafe(x, y, SLIME_COLOR, screen_pixels);
-                }
+                ; // spin
             }
         }
+        // Way behind? Start over from now instead of rushing to catch up.
+        pacer->deadline += pacer->period;
+        if (pacer->deadline < now) pacer->deadline = now + pacer->period;
+    }
+    else if ((now - pacer->last) > pacer->refresh + pacer->refresh/2)
+    {
+        pacer->nmissed++; // took longer than a refresh
     }
+
+    double ms = (double)(now - pacer->last) * 1e3 / (double)pacer->freq;
+    pacer->last = now;
+    pacer->nframes++;
+    pacer->sum_ms += ms;
+    pacer->sum_sq_ms += ms*ms;
+    if (ms > pacer->max_ms) pacer->max_ms = ms;
+    if (pacer->nframes >= PACER_REPORT_FRAMES) PacerReport(pacer);
 }
 
-void internal DrawBorder(u32 * screen_pixels)
+// ---------------
+// | Metrics lib |
+// ---------------
+
+/** Metrics endpoint
+ *
+ * With --metrics PORT, a thread serves the simulation counters in
+ * Prometheus text format on http://127.0.0.1:PORT/metrics.
+ *
+ * The game loop owns `metrics` and updates it once per tick. Then
+ * it publishes a copy under a sequence lock: the count is odd while
+ * the copy is being written. The server copies the snapshot and
+ * retries if the count was odd or changed meanwhile. The game loop
+ * never waits for a scrape.
+ *
+ * Sockets are POSIX only: on Windows --metrics just logs that it is
+ * not available.
+ */
+
+// Upper bounds of the tick time histogram buckets, in seconds
+static const double metrics_tick_bounds[] = {0.0005, 0.001, 0.002, 0.004, 0.008, 0.016, 0.032};
+#define METRICS_NBOUNDS ((int)(sizeof(metrics_tick_bounds)/sizeof(metrics_tick_bounds[0])))
+#define METRICS_POLL_MS 250 // how often the server checks for quit
+#define METRICS_REQUEST_MAX 65536 // read at most this much of a request
+#define METRICS_READ_SPINS 1000 // seqlock retries before the reader sleeps
+// A scraper that hangs up early must not SIGPIPE the game.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS: SO_NOSIGPIPE on the socket instead
+#endif
+
+typedef struct
 {
-        // ---Draw a border of bricks---
-        for (int x=0; x < SCREEN_HEIGHT; x++)
+    u64 ticks;
+    double tick_seconds_sum;
+    u64 tick_buckets[METRICS_NBOUNDS]; // ticks at or under each bound
+    int cells_moved;    // last tick
+    u64 cells_moved_total;
+    int awake_chunks;   // chunks where something moved last tick
+    int material[NTYPES];
+    u64 lost_total;
+    int capture_dropped;
+    u64 arena_bytes;
+    u64 capture_bytes;
+    u64 trace_bytes;
+} metrics_t;
+
+metrics_t metrics; // game loop only
+
+typedef struct
+{
+    metrics_t shared;  // the published snapshot
+    SDL_atomic_t seq;  // odd while shared is being written
+    SDL_atomic_t quit;
+    SDL_Thread *thread;
+    int listen_fd;
+} metrics_server_t;
+
+metrics_server_t metrics_server;
+
+/**
+ *  \brief Game loop: count a tick, then publish the snapshot.
+ *
+ *  \param sim_seconds  How long the simulation took
+ *  \param simulated    false if the tick was held (rewind)
+ */
+internal void MetricsTick(double sim_seconds, bool simulated)
+{
+    metrics.ticks++;
+    metrics.tick_seconds_sum += sim_seconds;
+    for (int i=0; i < METRICS_NBOUNDS; i++)
+    {
+        if (sim_seconds <= metrics_tick_bounds[i]) metrics.tick_buckets[i]++;
+    }
+    metrics.cells_moved = 0;
+    metrics.awake_chunks = 0;
+    if (simulated)
+    {
+        for (int chunk=0; chunk < NCHUNKS; chunk++)
         {
-            ColorSetUnsafe(x, 0, colors[BRICK], screen_pixels);
-            ColorSetUnsafe(x, SCREEN_WIDTH-1, colors[BRICK], screen_pixels);
+            metrics.cells_moved += population.chunk_active[chunk];
+            metrics.awake_chunks += (population.chunk_active[chunk] > 0) ? 1 : 0;
         }
-        for (int y=0; y < SCREEN_WIDTH; y++)
+    }
+    metrics.cells_moved_total += metrics.cells_moved;
+    memcpy(metrics.material, population.material, sizeof(metrics.material));
+    metrics.lost_total = population.lost_total;
+    metrics.capture_dropped = capture.ndropped_total;
+
+    if (!metrics_server.thread) return; // nobody is listening
+    SDL_AtomicAdd(&metrics_server.seq, 1); // odd: writing
+    SDL_MemoryBarrierRelease(); // odd before the copy
+    metrics_server.shared = metrics;
+    SDL_MemoryBarrierRelease(); // the copy before even
+    SDL_AtomicAdd(&metrics_server.seq, 1); // even: done
+}
+
+#ifndef _WIN32
+/**
+ *  \brief Server: a consistent copy of the published snapshot.
+ */
+internal void MetricsRead(metrics_t *snapshot)
+{
+    for (int tries=0; ; tries++)
+    {
+        int seq = SDL_AtomicGet(&metrics_server.seq);
+        if (!(seq & 1))
         {
-            ColorSetUnsafe(0, y, colors[BRICK], screen_pixels);
-            ColorSetUnsafe(SCREEN_HEIGHT-1, y, colors[BRICK], screen_pixels);
+            SDL_MemoryBarrierAcquire(); // seq before the copy
+            *snapshot = metrics_server.shared;
+            SDL_MemoryBarrierAcquire(); // the copy before seq again
+            if (SDL_AtomicGet(&metrics_server.seq) == seq) return;
+        }
+        // Being written. It is a short copy: spin a little, then
+        // stop burning a core and let the game loop finish it.
+        if (tries < METRICS_READ_SPINS)
+        {
+#ifdef __SSE2__
+            _mm_pause();
+#endif
         }
+        else
+        {
+            SDL_Delay(1);
+        }
+    }
 }
 
 /**
- *  \brief Draw particles in NEXT based on PREV
+ *  \brief Server: the snapshot in Prometheus text format.
  *
+ *  \return length of text
  */
-internal void DrawParticles(
-        u32 *screen_pixels_prev, u32 *screen_pixels_next,
-        momentum_t *momentum_prev, momentum_t *momentum_next
-        )
+internal int MetricsFormat(char *text, int size, const metrics_t *m)
 {
-    for (int row=0; row < SCREEN_HEIGHT; row++)
+    static const char *material_names[NTYPES] = {"sand", "slime", "water", "brick", "smoke", "steam", "fire"};
+    int n = 0;
+#define METRICS_PRINT(...) n += snprintf(text + n, (n < size) ? size - n : 0, __VA_ARGS__)
+    METRICS_PRINT("# HELP falling_tick_seconds Time to simulate one tick.\n"
+                  "# TYPE falling_tick_seconds histogram\n");
+    for (int i=0; i < METRICS_NBOUNDS; i++)
     {
-        for (int col=0; col < SCREEN_WIDTH; col++)
+        METRICS_PRINT("falling_tick_seconds_bucket{le=\"%g\"} %llu\n",
+                      metrics_tick_bounds[i], (unsigned long long)m->tick_buckets[i]);
+    }
+    METRICS_PRINT("falling_tick_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)m->ticks);
+    METRICS_PRINT("falling_tick_seconds_sum %.9f\n", m->tick_seconds_sum);
+    METRICS_PRINT("falling_tick_seconds_count %llu\n", (unsigned long long)m->ticks);
+    METRICS_PRINT("# HELP falling_cells_moved Particles that moved in the last tick.\n"
+                  "# TYPE falling_cells_moved gauge\n"
+                  "falling_cells_moved %d\n", m->cells_moved);
+    METRICS_PRINT("# HELP falling_cells_moved_total Particles moved, summed over ticks.\n"
+                  "# TYPE falling_cells_moved_total counter\n"
+                  "falling_cells_moved_total %llu\n", (unsigned long long)m->cells_moved_total);
+    METRICS_PRINT("# HELP falling_awake_chunks Chunks where something moved in the last tick.\n"
+                  "# TYPE falling_awake_chunks gauge\n"
+                  "falling_awake_chunks %d\n", m->awake_chunks);
+    METRICS_PRINT("# HELP falling_particles Particles of each material.\n"
+                  "# TYPE falling_particles gauge\n");
+    for (int type=0; type < NTYPES; type++)
+    {
+        if (type == BRICK) continue; // the border is not counted
+        METRICS_PRINT("falling_particles{material=\"%s\"} %d\n", material_names[type], m->material[type]);
+    }
+    METRICS_PRINT("# HELP falling_particles_lost_total Particles overwritten by another.\n"
+                  "# TYPE falling_particles_lost_total counter\n"
+                  "falling_particles_lost_total %llu\n", (unsigned long long)m->lost_total);
+    METRICS_PRINT("# HELP falling_capture_dropped_frames_total Frames capture dropped (writer behind).\n"
+                  "# TYPE falling_capture_dropped_frames_total counter\n"
+                  "falling_capture_dropped_frames_total %d\n", m->capture_dropped);
+    METRICS_PRINT("# HELP falling_memory_bytes Memory held, by pool.\n"
+                  "# TYPE falling_memory_bytes gauge\n"
+                  "falling_memory_bytes{pool=\"arena\"} %llu\n"
+                  "falling_memory_bytes{pool=\"capture\"} %llu\n"
+                  "falling_memory_bytes{pool=\"trace\"} %llu\n",
+                  (unsigned long long)m->arena_bytes, (unsigned long long)m->capture_bytes,
+                  (unsigned long long)m->trace_bytes);
+#undef METRICS_PRINT
+    return intmin(n, size - 1);
+}
+
+internal void MetricsServe(int fd)
+{
+    // Whatever was asked, the answer is the metrics. But read (and
+    // throw away) the request up to the blank line after its headers
+    // first: closing with unread bytes resets the connection, and the
+    // client may lose the answer.
+    char request[1024 + 1];
+    int nrequest = 0;
+    int nread = 0;
+    while (nread < METRICS_REQUEST_MAX)
+    {
+        struct pollfd readable = {fd, POLLIN, 0};
+        if (poll(&readable, 1, METRICS_POLL_MS) <= 0) break; // quiet: answer anyway
+        int n = (int)recv(fd, request + nrequest, sizeof(request) - 1 - nrequest, 0);
+        if (n < 0) return;
+        if (n == 0) break; // done sending
+        nrequest += n;
+        nread += n;
+        request[nrequest] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        // Keep the tail: the blank line may span two reads.
+        if (nrequest > 3)
         {
-            /* int dy=0; // dy is 0, +1 or -1 */
-            /* int dx=0; // dx is 0, +1 or -1 */
-            momentum_t momentum = MomentumAt(row, col, momentum_prev);
-            /* momentum.dx = 0; */
-            momentum.dy = 0;
-            u32 color             = ColorAt(row,   col,   screen_pixels_prev);
-            u32 color_below       = ColorAt(row+1, col,   screen_pixels_prev);
-            u32 color_below_right = ColorAt(row+1, col+1, screen_pixels_prev);
-            u32 color_below_left  = ColorAt(row+1, col-1, screen_pixels_prev);
-            u32 color_right       = ColorAt(row,   col+1, screen_pixels_prev);
-            u32 color_left        = ColorAt(row,   col-1, screen_pixels_prev);
-            // For WATER, also need to look at color in NEXT frame
-            u32 color_next        = ColorAt(row,   col,   screen_pixels_next);
-            u32 color_below_next  = ColorAt(row+1, col,   screen_pixels_next);
-            u32 color_right_next  = ColorAt(row,   col+1, screen_pixels_next);
-            u32 color_left_next   = ColorAt(row,   col-1, screen_pixels_next);
-            switch (color)
-            {
+            memmove(request, request + nrequest - 3, 3);
+            nrequest = 3;
+        }
+    }
+    char body[8192];
+    metrics_t snapshot;
+    MetricsRead(&snapshot);
+    int nbody = MetricsFormat(body, sizeof(body), &snapshot);
+    char header[256];
+    int nheader = sprintf(header,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n"
+            "Connection: close\r\n\r\n", nbody);
+    if (send(fd, header, nheader, MSG_NOSIGNAL) == nheader) send(fd, body, nbody, MSG_NOSIGNAL);
+}
 
-                case SAND_COLOR:
-                    // Fall down if nothing is below.
-                    if (color_below == NOTHING_COLOR)
-                    {
-                        momentum.dx = 1;
-                        momentum.dy = 0;
-                    }
-                    // Stop falling straight down if SAND or BRICK is below.
-                    if (
-                            (color_below == SAND_COLOR)
-                         || (color_below == BRICK_COLOR)
-                       )
-                    {
-                        // If nothing on either side, pick a side at RANDOM:
-                        if (
-                               (color_below_right == NOTHING_COLOR)
-                            && (color_below_left  == NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dx = 1;
-                            // Pick a random left (-1) or right (+1)
-                            momentum.dy = (rand()%2 == 1) ? 1 : -1;
-                        }
-                        // If nothing on left only, fall to the left:
-                        if (
-                               (color_below_right != NOTHING_COLOR)
-                            && (color_below_left  == NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dx = 1;
-                            momentum.dy = -1;
-                        }
-                        // If nothing on right only, fall to the right:
-                        if (
-                               (color_below_right == NOTHING_COLOR)
-                            && (color_below_left  != NOTHING_COLOR)
-                            )
-                        {
-                            momentum.dx = 1;
-                            momentum.dy = 1;
-                        }
-                        // If something on both sides, don't fall.
-                        if (
-                               (color_below_right != NOTHING_COLOR)
-                            && (color_below_left  != NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dx = 0;
-                            momentum.dy = 0;
-                        }
-                    }
-                    // Temporary fix: stop falling no matter what is below.
-                    else if (color_below != NOTHING_COLOR)
-                    {
-                        momentum.dx=0;
-                    }
-                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
-                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
-                    break;
+internal int MetricsThread(void *data)
+{
+    (void)data;
+    TraceNameThread("metrics");
+    while (!SDL_AtomicGet(&metrics_server.quit))
+    {
+        struct pollfd listening = {metrics_server.listen_fd, POLLIN, 0};
+        if (poll(&listening, 1, METRICS_POLL_MS) <= 0) continue;
+        int fd = accept(metrics_server.listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+#ifdef SO_NOSIGPIPE
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+        MetricsServe(fd);
+        close(fd);
+    }
+    return 0;
+}
+#endif
+
+/**
+ *  \brief Serve metrics on 127.0.0.1:port from a thread.
+ *
+ *  \return false if the port cannot be opened
+ */
+internal bool MetricsStart(int port, const arena_t *arena)
+{
+    metrics.arena_bytes = arena->size;
+    metrics.capture_bytes = (u64)CAPTURE_POOL * VIEW_WIDTH * VIEW_HEIGHT * sizeof(u32);
+    metrics.trace_bytes = sizeof(trace_events);
+#ifdef _WIN32
+    (void)port;
+    log_to_file("Metrics: not available on Windows\n");
+    return false;
+#else
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((u16)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // never the network
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(fd, 4) < 0))
+    {
+        sprintf(log_msg, "Metrics: cannot listen on 127.0.0.1:%d\n", port);
+        log_to_file(log_msg);
+        close(fd);
+        return false;
+    }
+    metrics_server.listen_fd = fd;
+    SDL_AtomicSet(&metrics_server.quit, 0);
+    metrics_server.thread = SDL_CreateThread(MetricsThread, "metrics", NULL);
+    assert(metrics_server.thread);
+    sprintf(log_msg, "Metrics: http://127.0.0.1:%d/metrics\n", port);
+    log_to_file(log_msg);
+    return true;
+#endif
+}
+
+internal void MetricsShutdown(void)
+{
+#ifndef _WIN32
+    if (!metrics_server.thread) return;
+    SDL_AtomicSet(&metrics_server.quit, 1);
+    SDL_WaitThread(metrics_server.thread, NULL);
+    metrics_server.thread = NULL;
+    close(metrics_server.listen_fd);
+#endif
+}
+
+// ---------
+// | Grids |
+// ---------
+
+typedef struct
+{
+    // World sized, double buffered: the simulation reads [0] and
+    // writes [1], then they swap.
+    u32 *pixels[2];
+    momentum_t *momentum[2];
+    look_t *looks[2];
+    // View sized, for rendering.
+    u32 *bgnd;
+    u32 *layer_green;
+    u32 *layer_red;
+    u32 *composite;
+    u32 *view;
+    u32 *minimap; // VIEW_WIDTH x MinimapRect().h
+} grids_t;
+
+/**
+ *  \brief Hand out every grid from the arena (see Memory lib).
+ *
+ *  \param with_view Also the view grids, the mip pyramid, the light
+ *                   grid and the history. The benchmark only
+ *                   simulates.
+ */
+internal void AllocGrids(arena_t *arena, grids_t *grids, bool with_view)
+{
+    memset(grids, 0, sizeof(*grids));
+    for (int i=0; i < 2; i++)
+    {
+        grids->pixels[i]   = (u32*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
+        grids->momentum[i] = (momentum_t*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(momentum_t));
+        grids->looks[i]    = (look_t*) ArenaGrid(arena, SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(look_t));
+    }
+    DensityInit(arena);
+    GasInit(arena);
+    ReactionsInit(arena);
+    if (!with_view) return;
+    grids->bgnd        = (u32*) ArenaGrid(arena, VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+    grids->layer_green = (u32*) ArenaGrid(arena, VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+    grids->layer_red   = (u32*) ArenaGrid(arena, VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+    grids->composite   = (u32*) ArenaGrid(arena, VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+    grids->view        = (u32*) ArenaGrid(arena, VIEW_WIDTH * VIEW_HEIGHT, sizeof(u32));
+    grids->minimap     = (u32*) ArenaGrid(arena, VIEW_WIDTH * MinimapRect().h, sizeof(u32));
+    PyramidInit(arena);
+    LightInit(arena);
+    HistoryAlloc(arena);
+}
+
+/**
+ *  \brief Measure, allocate and hand out all the grids in one go.
+ */
+internal bool GridsInit(arena_t *arena, grids_t *grids, bool with_view)
+{
+    memset(arena, 0, sizeof(*arena));
+    AllocGrids(arena, grids, with_view);
+    if (!ArenaInit(arena)) return false;
+    AllocGrids(arena, grids, with_view);
+    return true;
+}
+
+
+// -----------------
+// | Benchmark lib |
+// -----------------
+
+/** Headless benchmark
+ *
+ *      ./falling-something --bench [nticks]
+ *
+ * Runs the simulation for nticks without opening a window and
+ * prints timings to stdout (and log.txt).
+ *
+ * On Linux it also reads hardware counters with perf_event_open,
+ * one group of counters per job worker thread, added up. The
+ * counters are only enabled around the simulation phase, so they
+ * measure DrawParticles (plus clearing NEXT) on every worker, not
+ * setup. If
+ * the counters are not available (not Linux, a VM without a PMU,
+ * /proc/sys/kernel/perf_event_paranoid too strict), the benchmark
+ * reports the timings and says which counters are missing.
+ */
+
+#define BENCH_TICKS 1000
+#define BENCH_NSEED (10*NP)
+
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    NPERF_COUNTERS
+};
+
+static const char *perf_counter_names[NPERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "branch-misses",
+    "L1-dcache-load-misses",
+    "LLC-load-misses"
+};
 
-                case SLIME_COLOR:
-                    // Fall down if nothing is below AND nothing
-                    // will be below.
-                    if (
-                            (color_below == NOTHING_COLOR)
-                         && (color_below_next == NOTHING_COLOR)
-                       )
-                    {
-                        momentum.dx = 1;
-                        /* dy = 0; */
-                    }
-                    // Stop falling if ANYTHING is below.
-                    else
-                    {
-                        momentum.dx = 0;
+typedef struct
+{
+    int fd[NPERF_COUNTERS]; // -1 if this counter is not available
+    int leader;             // fd of the group leader, -1 if no counters
+} perf_group_t;
 
-                        // Make SLIME sticky!
-                        // Give SLIME a 1 out of 47 chance of moving.
-                        bool is_moving = (rand()%47 == 1) ? true : false;
+typedef struct
+{
+    perf_group_t groups[MAX_WORKERS]; // one per job worker thread
+    int ngroups;
+    int leader;                       // -1 if no counters on any worker
+    bool available[NPERF_COUNTERS];   // counting on every worker
+    u64 value[NPERF_COUNTERS];        // added up over the workers
+} perf_counters_t;
 
-                        if (is_moving)
-                        {
+#ifdef __linux__
+/**
+ *  \brief Open one counter on thread tid (any thread of ours).
+ */
+internal int PerfOpen(u32 type, u64 config, int tid, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group_fd == -1); // leader starts disabled
+    attr.exclude_kernel = 1; // works with perf_event_paranoid=2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+    return (int)syscall(SYS_perf_event_open, &attr, tid, -1, group_fd, 0);
+}
+#endif
 
-                            /* dx = 0; */
-                            // If nothing on either side, pick a side at RANDOM:
-                            if (
-                                    (color_right      == NOTHING_COLOR)
-                                 && (color_right_next == NOTHING_COLOR)
-                                 && (color_left       == NOTHING_COLOR)
-                                 && (color_left_next  == NOTHING_COLOR)
-                               )
-                            {
-                                momentum.dy = (rand()%2 == 1) ? 1 : -1;
-                            }
-                            // If nothing on left only, flow left:
-                            else if (
-                                   (color_right      != NOTHING_COLOR)
-                                && (color_left       == NOTHING_COLOR)
-                                && (color_left_next  == NOTHING_COLOR)
-                               )
-                            {
-                                momentum.dy = -1;
-                            }
-                            // If nothing on right only, flow right:
-                            else if (
-                                   (color_right      == NOTHING_COLOR)
-                                && (color_right_next == NOTHING_COLOR)
-                                && (color_left       != NOTHING_COLOR)
-                               )
-                            {
-                                momentum.dy = 1;
-                            }
-                        }
-                    }
-                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
-                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
-                    break;
+/**
+ *  \brief Open a counter group on every job worker thread.
+ *
+ *  Call after JobsInit.
+ */
+internal void PerfCountersOpen(perf_counters_t *pc)
+{
+    pc->leader = -1;
+    pc->ngroups = 0;
+    for (int i=0; i < NPERF_COUNTERS; i++)
+    {
+        pc->available[i] = false;
+        pc->value[i] = 0;
+    }
+#ifdef __linux__
+    const u32 types[NPERF_COUNTERS] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE
+    };
+    const u64 configs[NPERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        // Not PERF_COUNT_HW_CACHE_MISSES: that is not the LLC on every CPU.
+        PERF_COUNT_HW_CACHE_LL
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    for (int i=0; i < NPERF_COUNTERS; i++) pc->available[i] = true;
+    for (int w=0; w < job_system.nworkers; w++)
+    {
+        // A worker that did not start runs no jobs: nothing to count.
+        if ((w > 0) && !job_system.threads[w]) continue;
+        // Just started? Wait (a little) for it to say who it is.
+        for (int tries=0; (tries < 1000) && (SDL_AtomicGet(&job_system.workers[w].tid) == 0); tries++) SDL_Delay(1);
+        int tid = SDL_AtomicGet(&job_system.workers[w].tid);
+        perf_group_t *g = &pc->groups[pc->ngroups++];
+        g->leader = -1;
+        // The first counter that opens is the group leader. The others
+        // join its group so they all count over exactly the same code.
+        for (int i=0; i < NPERF_COUNTERS; i++)
+        {
+            g->fd[i] = (tid > 0) ? PerfOpen(types[i], configs[i], tid, g->leader) : -1;
+            if ((g->fd[i] >= 0) && (g->leader < 0)) g->leader = g->fd[i];
+            if (g->fd[i] < 0) pc->available[i] = false;
+        }
+        if (g->leader >= 0) pc->leader = g->leader;
+    }
+    if (pc->leader < 0)
+    {
+        for (int i=0; i < NPERF_COUNTERS; i++) pc->available[i] = false;
+    }
+#endif
+}
 
-                case WATER_COLOR:
-                    // Fall down if nothing is below AND nothing
-                    // will be below.
-                    if (
-                            (color_below == NOTHING_COLOR)
-                         && (color_below_next == NOTHING_COLOR)
-                       )
-                    {
-                        momentum.dx = 1;
-                        /* dy = 0; */
-                    }
-                    // Stop falling if ANYTHING is below.
-                    else
+inline internal void PerfCountersStart(perf_counters_t *pc)
+{
+#ifdef __linux__
+    for (int w=0; w < pc->ngroups; w++)
+    {
+        if (pc->groups[w].leader >= 0) ioctl(pc->groups[w].leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+inline internal void PerfCountersStop(perf_counters_t *pc)
+{
+#ifdef __linux__
+    for (int w=0; w < pc->ngroups; w++)
+    {
+        if (pc->groups[w].leader >= 0) ioctl(pc->groups[w].leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+/**
+ *  \brief Add up the counts of every worker into pc->value and close
+ *  the counters.
+ */
+internal void PerfCountersClose(perf_counters_t *pc)
+{
+#ifdef __linux__
+    for (int w=0; w < pc->ngroups; w++)
+    {
+        perf_group_t *g = &pc->groups[w];
+        if (g->leader < 0) continue;
+        // PERF_FORMAT_GROUP | PERF_FORMAT_ID:
+        //  { u64 nr; { u64 value; u64 id; } values[nr]; }
+        u64 buf[1 + 2*NPERF_COUNTERS];
+        if (read(g->leader, buf, sizeof(buf)) > 0)
+        {
+            for (u64 k=0; k < buf[0]; k++)
+            {
+                u64 id = buf[2 + 2*k];
+                for (int i=0; i < NPERF_COUNTERS; i++)
+                {
+                    u64 fd_id;
+                    if ((g->fd[i] >= 0) && (ioctl(g->fd[i], PERF_EVENT_IOC_ID, &fd_id) == 0) && (fd_id == id))
                     {
-                        momentum.dx = 0;
-                        // If the water has sideways momentum, it
-                        // should keep moving that way, even
-                        // through other water.
-                        if (momentum.dy != 0)
-                        {
-                            // Bump up the water in your path
-                            if (
-                                    (color_right      == WATER_COLOR)
-                                 && (color_right_next == WATER_COLOR)
-                                 && (color_left       == WATER_COLOR)
-                                 && (color_left_next  == WATER_COLOR)
-                               )
-                            {
-                                momentum_t bumped = {1, 0}; // bump up
-                                MomentumSetUnsafe(row, col+momentum.dy, bumped, momentum_next);
-                            }
-                        }
-                        // If dy==0 and nothing on either side, pick a side at RANDOM:
-                        if (
-                                (momentum.dy == 0)
-                             && (color_right      == NOTHING_COLOR)
-                             && (color_right_next == NOTHING_COLOR)
-                             && (color_left       == NOTHING_COLOR)
-                             && (color_left_next  == NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dy = (rand()%2 == 1) ? 1 : -1;
-                        }
-                        // If nothing on left only, flow left:
-                        else if (
-                               (color_right      != NOTHING_COLOR)
-                            && (color_left       == NOTHING_COLOR)
-                            && (color_left_next  == NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dy = -1;
-                        }
-                        // If nothing on right only, flow right:
-                        else if (
-                               (color_right      == NOTHING_COLOR)
-                            && (color_right_next == NOTHING_COLOR)
-                            && (color_left       != NOTHING_COLOR)
-                           )
-                        {
-                            momentum.dy = 1;
-                        }
-                        // Keep flowing in the same direction
-                        else
-                        {
-                            ; // momentum.dy stays the same
-                        }
-                        //
+                        pc->value[i] += buf[1 + 2*k];
                     }
-                    ColorSetUnsafe(row+momentum.dx, col+momentum.dy, color, screen_pixels_next);
-                    MomentumSetUnsafe(row+momentum.dx, col+momentum.dy, momentum, momentum_next);
-                    break;
-                case BRICK_COLOR:
-                    break;
-                case NOTHING_COLOR:
-                    break;
-                default:
-                    break;
+                }
+            }
+        }
+        for (int i=0; i < NPERF_COUNTERS; i++)
+        {
+            if (g->fd[i] >= 0) close(g->fd[i]);
+        }
+    }
+#endif
+}
+
+internal void bench_print(const char *msg)
+{
+    printf("%s", msg);
+    log_to_file(msg);
+}
+
+internal int RunBenchmark(int nticks)
+{
+    SDL_Init(SDL_INIT_TIMER);
+    srand(1); // same world every run
+
+    arena_t arena;
+    grids_t grids;
+    bool grids_ok = GridsInit(&arena, &grids, false);
+    assert(grids_ok);
+    ArenaLog(&arena, "Benchmark");
+    u32 *screen_pixels_prev = grids.pixels[0];
+    u32 *screen_pixels_next = grids.pixels[1];
+    momentum_t *momentum_prev = grids.momentum[0];
+    momentum_t *momentum_next = grids.momentum[1];
+    look_t *looks_prev = grids.looks[0];
+    look_t *looks_next = grids.looks[1];
+
+    rect_t empty_space = {0,0, SCREEN_WIDTH, SCREEN_HEIGHT};
+    InitParticles(screen_pixels_prev, looks_prev, BENCH_NSEED, ALL_TYPES);
+    DrawBorder(screen_pixels_prev, looks_prev);
+    PopulationReset(screen_pixels_prev);
+    int nparticles_start = PopulationTotal();
+
+    perf_counters_t pc;
+    PerfCountersOpen(&pc);
+    JobsResetStats();
+
+    const double ms_per_tick = 1e3 / (double)SDL_GetPerformanceFrequency();
+    double total_ms = 0;
+    double min_ms = 1e30;
+    double max_ms = 0;
+    for (int tick=0; tick < nticks; tick++)
+    {
+        u64 t0 = SDL_GetPerformanceCounter();
+        PerfCountersStart(&pc);
+        FillRect(empty_space, NOTHING_COLOR, screen_pixels_next);
+        FillLookRect(empty_space, LOOK(LOOK_NOTHING, 0), looks_next);
+        DrawBorder(screen_pixels_next, looks_next);
+        DrawParticles(screen_pixels_prev, screen_pixels_next, momentum_prev, momentum_next,
+                      looks_prev, looks_next);
+        PerfCountersStop(&pc);
+        double ms = (double)(SDL_GetPerformanceCounter() - t0) * ms_per_tick;
+        total_ms += ms;
+        if (ms < min_ms) min_ms = ms;
+        if (ms > max_ms) max_ms = ms;
+
+        u32 *tmp_pix = screen_pixels_prev;
+        screen_pixels_prev = screen_pixels_next;
+        screen_pixels_next = tmp_pix;
+        momentum_t *tmp_mom = momentum_prev;
+        momentum_prev = momentum_next;
+        momentum_next = tmp_mom;
+        look_t *tmp_looks = looks_prev;
+        looks_prev = looks_next;
+        looks_next = tmp_looks;
+    }
+    PerfCountersClose(&pc);
+
+    const double ncells = (double)SCREEN_WIDTH * SCREEN_HEIGHT * nticks;
+    sprintf(log_msg, "Benchmark: %d ticks of a %dx%d world, %d workers\n",
+            nticks, SCREEN_WIDTH, SCREEN_HEIGHT, job_system.nworkers);
+    bench_print(log_msg);
+    sprintf(log_msg, "\tsim ms/tick: mean %.4f, min %.4f, max %.4f\n", total_ms/nticks, min_ms, max_ms);
+    bench_print(log_msg);
+    sprintf(log_msg, "\tns/cell: %.3f\n", total_ms*1e6/ncells);
+    bench_print(log_msg);
+    sprintf(log_msg, "\tparticles: %d at start, %d at end, %llu lost to overwrites (counts %s a grid scan)\n",
+            nparticles_start, PopulationTotal(), (unsigned long long)population.lost_total,
+            PopulationCheck(screen_pixels_prev) ? "match" : "DO NOT match");
+    bench_print(log_msg);
+    if (pc.leader < 0)
+    {
+        bench_print("\tHardware counters: not available\n");
+    }
+    else
+    {
+        if (pc.ngroups > 1) sprintf(log_msg, "\tHardware counters (sim phase only, added up over %d workers):\n", pc.ngroups);
+        else                sprintf(log_msg, "\tHardware counters (sim phase only):\n");
+        bench_print(log_msg);
+        for (int i=0; i < NPERF_COUNTERS; i++)
+        {
+            if (!pc.available[i])
+            {
+                sprintf(log_msg, "\t\t%-22s not available\n", perf_counter_names[i]);
             }
+            else
+            {
+                sprintf(log_msg, "\t\t%-22s %14llu  (%.1f/tick)\n",
+                        perf_counter_names[i],
+                        (unsigned long long)pc.value[i], (double)pc.value[i]/nticks);
+            }
+            bench_print(log_msg);
+        }
+        if (pc.available[PERF_CYCLES] && pc.available[PERF_INSTRUCTIONS] && (pc.value[PERF_CYCLES] > 0))
+        {
+            sprintf(log_msg, "\t\tinstructions/cycle      %.3f\n",
+                    (double)pc.value[PERF_INSTRUCTIONS]/(double)pc.value[PERF_CYCLES]);
+            bench_print(log_msg);
+        }
+        if (pc.available[PERF_CYCLES])
+        {
+            sprintf(log_msg, "\t\tcycles/cell             %.3f\n", (double)pc.value[PERF_CYCLES]/ncells);
+            bench_print(log_msg);
         }
     }
+
+    bench_print("\tJob workers:\n");
+    JobsReport(true);
+
+    ArenaFree(&arena);
+    SDL_Quit();
+    return 0;
 }
 
 
 int main(int argc, char **argv)
 {
     clear_log_file();
+    TraceNameThread("main");
+
+    // ---Command line---
+    int target_fps = TARGET_FPS;
+    bool want_vsync = false;
+    bool capture_ppm = false;
+    int nworkers = 0; // one per CPU
+    int bench_ticks = 0;
+    int metrics_port = 0; // no metrics server
+    for (int i=1; i < argc; i++)
+    {
+        // ---Headless benchmark---
+        if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench_ticks = (i+1 < argc) ? atoi(argv[i+1]) : BENCH_TICKS;
+            if (bench_ticks < 1) bench_ticks = BENCH_TICKS;
+        }
+        // ---Job system---
+        else if ((strcmp(argv[i], "--threads") == 0) && (i+1 < argc))
+        {
+            nworkers = atoi(argv[++i]);
+        }
+        // ---Skip SDL_Renderer, draw in the window surface---
+        else if (strcmp(argv[i], "--surface") == 0)
+        {
+            present_to_surface = true;
+            composite_on_cpu = true; // the surface only gets one layer
+        }
+        // ---Frame pacing---
+        else if (strcmp(argv[i], "--vsync") == 0)
+        {
+            want_vsync = true;
+        }
+        else if ((strcmp(argv[i], "--fps") == 0) && (i+1 < argc))
+        {
+            target_fps = atoi(argv[++i]);
+            if (target_fps < 1) target_fps = TARGET_FPS;
+        }
+        // ---Frame capture---
+        else if (strcmp(argv[i], "--capture-ppm") == 0)
+        {
+            capture_ppm = true;
+        }
+        // ---Metrics endpoint---
+        else if ((strcmp(argv[i], "--metrics") == 0) && (i+1 < argc))
+        {
+            metrics_port = atoi(argv[++i]);
+        }
+    }
+    JobsInit(nworkers);
+    if (bench_ticks > 0)
+    {
+        int result = RunBenchmark(bench_ticks);
+        JobsShutdown();
+        return result;
+    }
 
     // ---------------
     // | Game window |
@@ -697,8 +5386,9 @@ int main(int argc, char **argv)
 
     SDL_Init(SDL_INIT_VIDEO);
 
+    const char *keys_title = "h,j,k,l,H,J,K,L,Space,s,w,Up,Down,Esc";
     SDL_Window *win = SDL_CreateWindow(
-            "h,j,k,l,H,J,K,L,Space,s,w,Up,Down,Esc", // const char *title
+            keys_title, // const char *title
             SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, // int x, int y
             SCALED_SCREEN_WIDTH, SCALED_SCREEN_HEIGHT, // int w, int h,
             SDL_WINDOW_RESIZABLE // Uint32 flags
@@ -706,12 +5396,35 @@ int main(int argc, char **argv)
             );
     assert(win); log_to_file("OK\n");
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(
-            win, // SDL_Window *
-            -1, // int index
-            SDL_RENDERER_ACCELERATED // Uint32 flags
-            );
-    assert(renderer); log_renderer_info(renderer);
+    SDL_Renderer *renderer = NULL;
+    bool have_vsync = false;
+    if (present_to_surface)
+    {
+        log_to_file("Presenting to the window surface, no renderer.\n");
+    }
+    else
+    {
+        renderer = SDL_CreateRenderer(
+                win, // SDL_Window *
+                -1, // int index
+                SDL_RENDERER_ACCELERATED // Uint32 flags
+                | (want_vsync ? SDL_RENDERER_PRESENTVSYNC : 0)
+                );
+        assert(renderer); log_renderer_info(renderer);
+
+        // No GPU? Then SDL blends the layers on the CPU anyway, one
+        // full-screen pass per layer. Do it in one pass instead.
+        SDL_RendererInfo info;
+        SDL_GetRendererInfo(renderer, &info);
+        if (info.flags & SDL_RENDERER_SOFTWARE) composite_on_cpu = true;
+        // Asked for vsync but did not get it? Then the pacer sleeps.
+        have_vsync = want_vsync && (info.flags & SDL_RENDERER_PRESENTVSYNC);
+    }
+    log_to_file("Compositor self-check against the blend equation... ");
+    bool compositor_ok = CompositorSelfCheck();
+    sprintf(log_msg, "%s\n", compositor_ok ? "PASS" : "FAIL");
+    log_to_file(log_msg);
+    assert(compositor_ok);
 
 
     // RGBA8888 is not available!
@@ -721,95 +5434,138 @@ int main(int argc, char **argv)
     // Confirm this format has an alpha channel
     assert(SDL_ISPIXELFORMAT_ALPHA(format->format));
 
-    // Alpha experimentation
-    SDL_Texture *layer_green = SDL_CreateTexture(
-            renderer, // SDL_Renderer *
-            format->format, // u32 SDL_PIXELFORMAT_RGBA888
-            SDL_TEXTUREACCESS_STREAMING, // Changes frequently
-            SCREEN_WIDTH, SCREEN_HEIGHT // int w, int h
-            );
-    assert(layer_green);
-    SDL_Texture *layer_red = SDL_CreateTexture(
-            renderer, // SDL_Renderer *
-            format->format, // u32 SDL_PIXELFORMAT_RGBA888
-            SDL_TEXTUREACCESS_STREAMING, // Changes frequently
-            SCREEN_WIDTH, SCREEN_HEIGHT // int w, int h
-            );
-    assert(layer_red);
+    // No textures when presenting to the window surface.
+    SDL_Texture *layer_green = NULL;
+    SDL_Texture *layer_red = NULL;
+    SDL_Texture *screen = NULL;
+    SDL_Texture *bgnd = NULL;
+    SDL_Texture *composite = NULL;
+    SDL_Texture *minimap = NULL;
+    if (renderer)
+    {
+        // Alpha experimentation
+        layer_green = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // u32 SDL_PIXELFORMAT_RGBA888
+                SDL_TEXTUREACCESS_STREAMING, // Changes frequently
+                VIEW_WIDTH, VIEW_HEIGHT // int w, int h
+                );
+        assert(layer_green);
+        layer_red = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // u32 SDL_PIXELFORMAT_RGBA888
+                SDL_TEXTUREACCESS_STREAMING, // Changes frequently
+                VIEW_WIDTH, VIEW_HEIGHT // int w, int h
+                );
+        assert(layer_red);
 
-    // Make these layers blend.
-    // Default is no blend:
-    //  -- one layer will completely hide the other.
-    // There are four blend modes. I'm using alpha blend.
-    // The math for each is in the comments in the header `SDL_blendmode.h`.
-    SDL_SetTextureBlendMode(layer_green, SDL_BLENDMODE_BLEND);
-    /* SDL_SetTextureBlendMode(layer_green, SDL_BLENDMODE_ADD); */
-    SDL_SetTextureBlendMode(layer_red, SDL_BLENDMODE_BLEND);
-    /* SDL_SetTextureBlendMode(layer_red, SDL_BLENDMODE_ADD); */
+        // Make these layers blend.
+        // Default is no blend:
+        //  -- one layer will completely hide the other.
+        // There are four blend modes. I'm using alpha blend.
+        // The math for each is in the comments in the header `SDL_blendmode.h`.
+        SDL_SetTextureBlendMode(layer_green, SDL_BLENDMODE_BLEND);
+        /* SDL_SetTextureBlendMode(layer_green, SDL_BLENDMODE_ADD); */
+        SDL_SetTextureBlendMode(layer_red, SDL_BLENDMODE_BLEND);
+        /* SDL_SetTextureBlendMode(layer_red, SDL_BLENDMODE_ADD); */
 
 
-    SDL_Texture *screen = SDL_CreateTexture(
-            renderer, // SDL_Renderer *
-            format->format, // Uint32 format,
-            SDL_TEXTUREACCESS_TARGET, // int access,
-            SCREEN_WIDTH, SCREEN_HEIGHT // int w, int h
-            );
-    assert(screen);
+        // STREAMING so UploadScreen can lock it and write into it.
+        screen = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // Uint32 format,
+                SDL_TEXTUREACCESS_STREAMING, // int access,
+                VIEW_WIDTH, VIEW_HEIGHT // int w, int h
+                );
+        assert(screen);
+
+        SDL_SetTextureBlendMode(screen, SDL_BLENDMODE_BLEND);
+
+        // Create a separate texture for background artwork.
+        // For now, just a solid color.
+        bgnd = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // Uint32 format,
+                SDL_TEXTUREACCESS_TARGET, // int access,
+                VIEW_WIDTH, VIEW_HEIGHT // int w, int h
+                );
+        assert(bgnd);
+
+        SDL_SetTextureBlendMode(bgnd, SDL_BLENDMODE_BLEND);
+
+        // The CPU compositor puts every layer in this one texture.
+        composite = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // Uint32 format,
+                SDL_TEXTUREACCESS_STREAMING, // int access,
+                VIEW_WIDTH, VIEW_HEIGHT // int w, int h
+                );
+        assert(composite);
+        SDL_SetTextureBlendMode(composite, SDL_BLENDMODE_NONE); // it is opaque
+
+        // The minimap goes on top of everything, opaque.
+        minimap = SDL_CreateTexture(
+                renderer, // SDL_Renderer *
+                format->format, // Uint32 format,
+                SDL_TEXTUREACCESS_STREAMING, // int access,
+                MinimapRect().w, MinimapRect().h // int w, int h
+                );
+        assert(minimap);
 
-    SDL_SetTextureBlendMode(screen, SDL_BLENDMODE_BLEND);
+        // Create a separate texture for me.
+        /* SDL_Texture *player = SDL_CreateTexture( */
+        /*         renderer, // SDL_Renderer * */
+        /*         format->format, // Uint32 format, */
+        /*         SDL_TEXTUREACCESS_TARGET, // int access, */
+        /*         VIEW_WIDTH, VIEW_HEIGHT // int w, int h */
+        /*         ); */
+        /* assert(player); */
 
-    // Create a separate texture for background artwork.
-    // For now, just a solid color.
-    SDL_Texture *bgnd = SDL_CreateTexture(
-            renderer, // SDL_Renderer *
-            format->format, // Uint32 format,
-            SDL_TEXTUREACCESS_TARGET, // int access,
-            SCREEN_WIDTH, SCREEN_HEIGHT // int w, int h
-            );
-    assert(bgnd);
-
-    SDL_SetTextureBlendMode(bgnd, SDL_BLENDMODE_BLEND);
-
-    // Create a separate texture for me.
-    /* SDL_Texture *player = SDL_CreateTexture( */
-    /*         renderer, // SDL_Renderer * */
-    /*         format->format, // Uint32 format, */
-    /*         SDL_TEXTUREACCESS_TARGET, // int access, */
-    /*         SCREEN_WIDTH, SCREEN_HEIGHT // int w, int h */
-    /*         ); */
-    /* assert(player); */
-
-    /* SDL_SetTextureBlendMode(player, SDL_BLENDMODE_BLEND); */
-
-    // Check the texture format
-    u32 format_check;
-    int access_check;
-    int w_check;
-    int h_check;
-    SDL_QueryTexture(screen, &format_check, &access_check, &w_check, &h_check);
-    sprintf(log_msg, "\tUsing texture format: %s\n", SDL_GetPixelFormatName(format_check));
-    log_to_file(log_msg);
-    sprintf(log_msg, "\tUsing texture access: %d\n", access_check);
-    log_to_file(log_msg);
+        /* SDL_SetTextureBlendMode(player, SDL_BLENDMODE_BLEND); */
 
-    u32 *screen_pixels_prev = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
-    assert(screen_pixels_prev);
+        // Check the texture format
+        u32 format_check;
+        int access_check;
+        int w_check;
+        int h_check;
+        SDL_QueryTexture(screen, &format_check, &access_check, &w_check, &h_check);
+        sprintf(log_msg, "\tUsing texture format: %s\n", SDL_GetPixelFormatName(format_check));
+        log_to_file(log_msg);
+        sprintf(log_msg, "\tUsing texture access: %d\n", access_check);
+        log_to_file(log_msg);
+    }
 
-    u32 *screen_pixels_next = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
-    assert(screen_pixels_next);
+    // Every grid, world and view sized, comes out of one arena.
+    arena_t arena;
+    grids_t grids;
+    bool grids_ok = GridsInit(&arena, &grids, true);
+    assert(grids_ok);
+    ArenaLog(&arena, "Grid");
 
-    momentum_t *momentum_prev = (momentum_t*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(momentum_t));
-    momentum_t *momentum_next = (momentum_t*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(momentum_t));
+    u32 *screen_pixels_prev = grids.pixels[0];
+    u32 *screen_pixels_next = grids.pixels[1];
+    momentum_t *momentum_prev = grids.momentum[0];
+    momentum_t *momentum_next = grids.momentum[1];
+    look_t *looks_prev = grids.looks[0];
+    look_t *looks_next = grids.looks[1];
 
-    u32 *bgnd_pixels = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
-    assert(bgnd_pixels);
+    // Layers under and over the simulation are the size of the view.
+    u32 *bgnd_pixels = grids.bgnd;
 
     /* u32 *player_pixels = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32)); */
     /* assert(player_pixels); */
 
     // Alpha experimentation
-    u32 *layer_green_pixels = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
-    u32 *layer_red_pixels   = (u32*) calloc(SCREEN_WIDTH * SCREEN_HEIGHT, sizeof(u32));
+    u32 *layer_green_pixels = grids.layer_green;
+    u32 *layer_red_pixels   = grids.layer_red;
+
+    u32 *composite_pixels = grids.composite;
+
+    // The colour pass of what the camera sees, for the compositor.
+    u32 *view_pixels = grids.view;
+
+    SDL_Rect minimap_rect = MinimapRect();
+    u32 *minimap_pixels = grids.minimap;
 
     bool done = false;
 
@@ -838,6 +5594,22 @@ int main(int argc, char **argv)
     // ARGB
     u32 me_color = 0xFF22FF00;
     /* u32 me_color = 0x80FFFFFF; */
+    PaletteInit(me_color);
+    // Where me was last drawn, to know when me moves.
+    rect_t me_drawn = me;
+    // Input moves me_input and sends it to the simulation as a
+    // teleport command (see Command lib).
+    rect_t me_input = me;
+    rect_t me_sent = me;
+    enum particle_type brush = SAND;
+    bool rewinding = false; // r is held down
+    int hud_countdown = 0;  // frames to the next title bar update
+    int heatmap_max_ns = 0; // costliest chunk, while the heatmap is on
+
+    camera_t camera = {0, 0, 0, true};
+    CameraUpdate(&camera, me);
+    // Where the camera was last drawn, to know when it moves.
+    camera_t camera_drawn = camera;
 
     // ----------------------------------
     // | Game graphics that do not move |
@@ -847,24 +5619,11 @@ int main(int argc, char **argv)
     rect_t empty_space = {0,0, SCREEN_WIDTH, SCREEN_HEIGHT};
 
     // Alpha experimentation
-    // Put big green rect on left side
-    rect_t green_shape = {
-        (1.0/4.0)*SCREEN_WIDTH,  // x top-left
-        (1.0/4.0)*SCREEN_HEIGHT, // y top-left
-        (1.0/2.0)*SCREEN_WIDTH,  // width
-        (1.0/2.0)*SCREEN_HEIGHT, // height
-    };
-    // Offset smaller red rect to the right and down a bit
-    rect_t red_shape = {
-        (1.0/2.0)*SCREEN_WIDTH,  // x top-left
-        (1.0/3.0)*SCREEN_HEIGHT, // y top-left
-        (1.0/3.0)*SCREEN_WIDTH,  // width
-        (1.0/3.0)*SCREEN_HEIGHT, // height
-    };
-    // Both buffers start off empty because calloc sets all bytes
-    // to 0x00000000. I only need to add color in the rect.
-    FillRect(green_shape, 0x8000FF00, layer_green_pixels);
-    FillRect(red_shape, 0x80FF0000, layer_red_pixels);
+    // These layers stay put on the screen when the camera moves.
+    // The activity heatmap takes their place while it is shown.
+    DrawAlphaExperiment(layer_green_pixels, layer_red_pixels);
+    layer_t green_layer = {layer_green, layer_green_pixels, true};
+    layer_t red_layer   = {layer_red,   layer_red_pixels,   true};
 
     // Modulate the background color
     u32 bgnd_color_flickering = BGND_COLOR;
@@ -873,11 +5632,23 @@ int main(int argc, char **argv)
     // | Noita |
     // ---------
     // Put a solid color in the background.
-    FillRect(empty_space, BGND_COLOR, bgnd_pixels);
+    // The background pixels are white. The color comes from the
+    // texture color and alpha mods: white * mod = mod. Flicker just
+    // changes the mods instead of refilling and re-uploading.
+    rect_t whole_view = {0,0, VIEW_WIDTH, VIEW_HEIGHT};
+    FillViewRect(whole_view, 0xFFFFFFFF, bgnd_pixels);
+    layer_t bgnd_layer = {bgnd, bgnd_pixels, true};
+    u32 bgnd_color_applied = ~bgnd_color_flickering; // force first update
+    u32 composited_base = 0; // the CPU compositor's last background
     // Clear the screen for InitParticles to have a clean canvas.
     FillRect(empty_space, NOTHING_COLOR, screen_pixels_prev);
-    InitParticles(screen_pixels_prev, NP, ALL_TYPES);
-    DrawBorder(screen_pixels_prev);
+    InitParticles(screen_pixels_prev, looks_prev, NP, ALL_TYPES);
+    DrawBorder(screen_pixels_prev, looks_prev);
+    PopulationReset(screen_pixels_prev);
+    HistoryReset(screen_pixels_prev, looks_prev);
+    // Nothing is in the screen texture yet.
+    MarkAllDirty();
+    RedrawAll();
 
     // -----------------
     // | Game controls |
@@ -886,17 +5657,33 @@ int main(int argc, char **argv)
     bool pressed_up    = false;
     bool pressed_left  = false;
     bool pressed_right = false;
+    bool pan_camera    = false; // Ctrl: h,j,k,l move the camera
+
+
+    pacer_t pacer;
+    int refresh_hz = 0;
+    if (have_vsync)
+    {
+        SDL_DisplayMode mode;
+        if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(win), &mode) == 0) refresh_hz = mode.refresh_rate;
+    }
+    PacerInit(&pacer, target_fps, have_vsync, refresh_hz);
 
+    CaptureInit(capture_ppm, target_fps);
+    if (metrics_port > 0) MetricsStart(metrics_port, &arena);
 
     // -------------
     // | GAME LOOP |
     // -------------
     while (!done)
     {
+        u64 t_frame = TraceBegin();
+
         // ----------------------
         // | Get keyboard input |
         // ----------------------
 
+        u64 t_input = TraceBegin();
         SDL_Event event;
         while(SDL_PollEvent(&event))
         {
@@ -914,185 +5701,262 @@ int main(int argc, char **argv)
                     break;
 
                 case SDLK_UP: // Up - Grow me
-                    me.w++;
-                    me.h++;
+                    me_input.w++;
+                    me_input.h++;
                     // Clamp at 10x10
                     // Clamp at 1x1
-                    if (me.w > 10) me.w=10;
-                    if (me.h > 10) me.h=10;
+                    if (me_input.w > 10) me_input.w=10;
+                    if (me_input.h > 10) me_input.h=10;
                     break;
                 case SDLK_DOWN: // Down - Shrink me
-                    me.w--;
-                    me.h--;
+                    me_input.w--;
+                    me_input.h--;
                     // Clamp at 1x1
-                    if (me.w < 1) me.w=1;
-                    if (me.h < 1) me.h=1;
+                    if (me_input.w < 1) me_input.w=1;
+                    if (me_input.h < 1) me_input.h=1;
                     break;
 
                 case SDLK_SPACE: // Space - more particles
-                    InitParticles(screen_pixels_prev, NP, ALL_TYPES);
+                    PushSpawn(ALL_TYPES, NP);
                     break;
 
                 case SDLK_s: // s - a little more sand
-                    InitParticles(screen_pixels_prev, NP, SAND);
+                    PushSpawn(SAND, NP);
+                    brush = SAND;
                     break;
 
                 case SDLK_w: // w - a little more water
-                    InitParticles(screen_pixels_prev, NP, WATER);
+                    PushSpawn(WATER, NP);
+                    brush = WATER;
                     break;
                 case SDLK_p: // p - a little more slime
-                    InitParticles(screen_pixels_prev, NP, SLIME);
+                    PushSpawn(SLIME, NP);
+                    brush = SLIME;
+                    break;
+                case SDLK_o: // o - a little smoke
+                    PushSpawn(SMOKE, NP);
+                    brush = SMOKE;
+                    break;
+                case SDLK_i: // i - a little steam
+                    PushSpawn(STEAM, NP);
+                    brush = STEAM;
+                    break;
+                case SDLK_n: // n - a little fire
+                    PushSpawn(FIRE, NP);
+                    brush = FIRE;
+                    break;
+
+                case SDLK_b: // b - brush: pour what s,w,p,o,i,n last made under me
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        rect_t below = {me_input.x, me_input.y + me_input.h, me_input.w, me_input.h};
+                        PushRect(CMD_BRUSH, brush, below);
+                    }
+                    break;
+
+                case SDLK_r: // r - rewind (hold)
+                    rewinding = (event.type == SDL_KEYDOWN);
+                    break;
+
+                case SDLK_u: // u - undo the last spawn, brush or erase
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        command_t undo = {CMD_UNDO, 0, 0, {0, 0, 0, 0}};
+                        CommandPush(&command_ring, undo);
+                    }
+                    break;
+
+                case SDLK_e: // e - erase around me
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        rect_t around = {
+                            me_input.x - me_input.w, me_input.y - me_input.h,
+                            3*me_input.w, 3*me_input.h
+                        };
+                        PushRect(CMD_ERASE, SAND, around);
+                    }
+                    break;
+
+                case SDLK_t: // t - record a trace
+                    if (event.type == SDL_KEYDOWN) TraceStart();
+                    break;
+
+                case SDLK_v: // v - start/stop recording video
+                    if (event.type == SDL_KEYDOWN) CaptureToggle();
+                    break;
+
+                case SDLK_c: // c - toggle the CPU compositor
+                    if ((event.type == SDL_KEYDOWN) && !present_to_surface)
+                    {
+                        composite_on_cpu = !composite_on_cpu;
+                        RedrawAll();
+                        // The compositor used up the layer dirty flags.
+                        green_layer.dirty = true;
+                        red_layer.dirty = true;
+                        bgnd_layer.dirty = true;
+                        sprintf(log_msg, "CPU compositor: %s\n", composite_on_cpu ? "on" : "off");
+                        log_to_file(log_msg);
+                    }
+                    break;
+
+                case SDLK_z: // z - zoom out
+                    if (event.type == SDL_KEYDOWN) camera.zoom = intmin(camera.zoom + 1, MAX_ZOOM);
+                    break;
+
+                case SDLK_x: // x - zoom in
+                    if (event.type == SDL_KEYDOWN) camera.zoom = intmax(camera.zoom - 1, 0);
+                    break;
+
+                case SDLK_f: // f - camera follows me (or not)
+                    if (event.type == SDL_KEYDOWN) camera.follow_me = !camera.follow_me;
+                    break;
+
+                case SDLK_g: // g - lighting on/off
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        lighting_on = !lighting_on;
+                        light_grid.all = true; // sources went stale while off
+                        RedrawAll();
+                    }
+                    break;
+
+                case SDLK_a: // a - show/hide the activity heatmap
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        heatmap.on = !heatmap.on;
+                        if (heatmap.on)
+                        {
+                            memset(red_layer.pixels, 0, VIEW_WIDTH * VIEW_HEIGHT * sizeof(u32));
+                        }
+                        else
+                        {
+                            DrawAlphaExperiment(green_layer.pixels, red_layer.pixels);
+                            heatmap_max_ns = 0;
+                        }
+                        green_layer.dirty = true;
+                        red_layer.dirty = true;
+                    }
+                    break;
+
+                case SDLK_m: // m - show/hide the minimap
+                    if (event.type == SDL_KEYDOWN)
+                    {
+                        show_minimap = !show_minimap;
+                        if (present_to_surface) RedrawAll(); // uncover what it hid
+                    }
                     break;
 
+                // Ctrl+h,j,k,l pans the camera instead of moving me.
                 case SDLK_j: // j - move me down
                     /* pressed_down = true; */
                     pressed_down = (event.type == SDL_KEYDOWN);
+                    pan_camera = (event.key.keysym.mod & KMOD_CTRL);
                     break;
 
                 case SDLK_k: // k - move me up
                     pressed_up = (event.type == SDL_KEYDOWN);
+                    pan_camera = (event.key.keysym.mod & KMOD_CTRL);
                     break;
 
                 case SDLK_h: // h - move me left
                     pressed_left = (event.type == SDL_KEYDOWN);
+                    pan_camera = (event.key.keysym.mod & KMOD_CTRL);
                     break;
 
                 case SDLK_l: // l - move me right
                     pressed_right = (event.type == SDL_KEYDOWN);
+                    pan_camera = (event.key.keysym.mod & KMOD_CTRL);
                     break;
 
                 default:
                     break;
             }
         }
-
-        // --------
-        // | DRAW |
-        // --------
-        // Modulate the background color
-        u32 Aflicker = 0;
-        u32 Rflicker = 0;
-        u32 Gflicker = 0;
-        u32 Bflicker = 0;
-        const u32 Amask = 0xFF000000;
-        const u32 Rmask = 0x00FF0000;
-        const u32 Gmask = 0x0000FF00;
-        const u32 Bmask = 0x000000FF;
-        const u32 Aflicker_max = BGND_FLICKER & Amask;
-        const u32 Rflicker_max = BGND_FLICKER & Rmask;
-        const u32 Gflicker_max = BGND_FLICKER & Gmask;
-        const u32 Bflicker_max = BGND_FLICKER & Bmask;
-        u8 flicker_rate = 17;
-        if (rand()%flicker_rate == 1)
-        {
-            if (Aflicker_max > 0) // % requires non-zero operand
-            {
-                Aflicker = (rand()%((Aflicker_max) >> 24)) << 24;
-            }
-            if (Rflicker_max > 0) // % requires non-zero operand
-            {
-                Rflicker = (rand()%((Rflicker_max) >> 16)) << 16;
-            }
-            if (Gflicker_max > 0) // % requires non-zero operand
-            {
-                Gflicker = (rand()%((Gflicker_max) >>  8)) <<  8;
-            }
-            if (Bflicker_max > 0) // % requires non-zero operand
-            {
-                Bflicker = (rand()%((Bflicker_max) >>  0)) <<  0;
-            }
-        }
-        u32 bgnd_color_a = (BGND_COLOR & Amask) + Aflicker;
-        u32 bgnd_color_r = (BGND_COLOR & Rmask) + Rflicker;
-        u32 bgnd_color_g = (BGND_COLOR & Gmask) + Gflicker;
-        u32 bgnd_color_b = (BGND_COLOR & Bmask) + Bflicker;
-
-        bgnd_color_flickering = bgnd_color_a | (bgnd_color_flickering & 0x00FFFFFF);
-        bgnd_color_flickering |= (bgnd_color_r | (bgnd_color_flickering & 0xFF00FFFF));
-        bgnd_color_flickering |= (bgnd_color_g | (bgnd_color_flickering & 0xFFFF00FF));
-        bgnd_color_flickering |= (bgnd_color_b | (bgnd_color_flickering & 0xFFFFFF00));
-        FillRect(empty_space, bgnd_color_flickering, bgnd_pixels);
-        // Clear the player
-        /* FillRect(empty_space, NOTHING_COLOR, player_pixels); */
-        // Clear the old particle position calculations
-        FillRect(empty_space, NOTHING_COLOR, screen_pixels_next);
-        DrawBorder(screen_pixels_next);
-        DrawParticles(screen_pixels_prev, screen_pixels_next, momentum_prev, momentum_next);
-
-        // ---Draw me---
+        // ---Move me---
         //
         // TODO: control me speed
         // TODO: add small delay after initial press before repeating movement
         // TODO: change shape based on direction of movement
-        if (pressed_down)
+        if (pan_camera)
+        {
+            // One eighth of the view per step.
+            int step_x = (VIEW_WIDTH  << camera.zoom) / 8;
+            int step_y = (VIEW_HEIGHT << camera.zoom) / 8;
+            if (pressed_down)  camera.y += step_y;
+            if (pressed_up)    camera.y -= step_y;
+            if (pressed_left)  camera.x -= step_x;
+            if (pressed_right) camera.x += step_x;
+            if (pressed_down || pressed_up || pressed_left || pressed_right) camera.follow_me = false;
+        }
+        else if (pressed_down)
         {
             if (SDL_GetModState() & KMOD_SHIFT)
             {
-                me.y = SCREEN_HEIGHT - me.h;
+                me_input.y = SCREEN_HEIGHT - me_input.h;
             }
             else
             {
-                if ((me.y + me.h) < SCREEN_HEIGHT) // not at bottom yet
+                if ((me_input.y + me_input.h) < SCREEN_HEIGHT) // not at bottom yet
                 {
-                    me.y += me.h;
+                    me_input.y += me_input.h;
                 }
                 else // wraparound
                 {
-                    me.y = 0;
+                    me_input.y = 0;
                 }
             }
         }
-        if (pressed_up)
+        if (pressed_up && !pan_camera)
         {
             if (SDL_GetModState() & KMOD_SHIFT)
             {
-                me.y = 0;
+                me_input.y = 0;
             }
             else
             {
-                if (me.y > me.h) // not at top yet
+                if (me_input.y > me_input.h) // not at top yet
                 {
-                    me.y -= me.h;
+                    me_input.y -= me_input.h;
                 }
                 else // wraparound
                 {
-                    me.y = SCREEN_HEIGHT - me.h;
+                    me_input.y = SCREEN_HEIGHT - me_input.h;
                 }
             }
         }
-        if (pressed_left)
+        if (pressed_left && !pan_camera)
         {
             if (SDL_GetModState() & KMOD_SHIFT)
             {
-                me.x = 0;
+                me_input.x = 0;
             }
             else
             {
-                if (me.x > 0)
+                if (me_input.x > 0)
                 {
-                    me.x -= me.w;
+                    me_input.x -= me_input.w;
                 }
                 else // moving left, wrap around to right sight of screen
                 {
-                    me.x = SCREEN_WIDTH - me.w;
+                    me_input.x = SCREEN_WIDTH - me_input.w;
                 }
             }
         }
-        if (pressed_right)
+        if (pressed_right && !pan_camera)
         {
             if (SDL_GetModState() & KMOD_SHIFT)
             {
-                me.x = SCREEN_WIDTH - me.w;
+                me_input.x = SCREEN_WIDTH - me_input.w;
             }
             else
             {
-                if (me.x < (SCREEN_WIDTH - me.w))
+                if (me_input.x < (SCREEN_WIDTH - me_input.w))
                 {
-                    me.x += me.w;
+                    me_input.x += me_input.w;
                 }
                 else // moving right, wrap around to left sight of screen
                 {
-                    me.x = 0;
+                    me_input.x = 0;
                 }
             }
         }
@@ -1100,23 +5964,146 @@ int main(int argc, char **argv)
         {
             if (pressed_down || pressed_up || pressed_left || pressed_right)
             {
-                sprintf(log_msg, "me (x,y) = (%d, %d)\n", me.x, me.y);
+                sprintf(log_msg, "me (x,y) = (%d, %d)\n", me_input.x, me_input.y);
                 log_to_file(log_msg);
             }
         }
+        if (   (me_input.x != me_sent.x) || (me_input.y != me_sent.y)
+            || (me_input.w != me_sent.w) || (me_input.h != me_sent.h))
+        {
+            PushRect(CMD_TELEPORT, SAND, me_input);
+            me_sent = me_input;
+        }
+
+        if (rewinding)
+        {
+            command_t rewind = {CMD_REWIND, 0, 1, {0, 0, 0, 0}}; // a tick per frame
+            CommandPush(&command_ring, rewind);
+        }
+        TraceEnd("input", "frame", t_input, -1);
+
+        // --------
+        // | DRAW |
+        // --------
+        // Modulate the background color
+        u64 t_bgnd = TraceBegin();
+        u32 Aflicker = 0;
+        u32 Rflicker = 0;
+        u32 Gflicker = 0;
+        u32 Bflicker = 0;
+        const u32 Amask = 0xFF000000;
+        const u32 Rmask = 0x00FF0000;
+        const u32 Gmask = 0x0000FF00;
+        const u32 Bmask = 0x000000FF;
+        const u32 Aflicker_max = BGND_FLICKER & Amask;
+        const u32 Rflicker_max = BGND_FLICKER & Rmask;
+        const u32 Gflicker_max = BGND_FLICKER & Gmask;
+        const u32 Bflicker_max = BGND_FLICKER & Bmask;
+        u8 flicker_rate = 17;
+        if (rand()%flicker_rate == 1)
+        {
+            if (Aflicker_max > 0) // % requires non-zero operand
+            {
+                Aflicker = (rand()%((Aflicker_max) >> 24)) << 24;
+            }
+            if (Rflicker_max > 0) // % requires non-zero operand
+            {
+                Rflicker = (rand()%((Rflicker_max) >> 16)) << 16;
+            }
+            if (Gflicker_max > 0) // % requires non-zero operand
+            {
+                Gflicker = (rand()%((Gflicker_max) >>  8)) <<  8;
+            }
+            if (Bflicker_max > 0) // % requires non-zero operand
+            {
+                Bflicker = (rand()%((Bflicker_max) >>  0)) <<  0;
+            }
+        }
+        u32 bgnd_color_a = (BGND_COLOR & Amask) + Aflicker;
+        u32 bgnd_color_r = (BGND_COLOR & Rmask) + Rflicker;
+        u32 bgnd_color_g = (BGND_COLOR & Gmask) + Gflicker;
+        u32 bgnd_color_b = (BGND_COLOR & Bmask) + Bflicker;
+
+        bgnd_color_flickering = bgnd_color_a | (bgnd_color_flickering & 0x00FFFFFF);
+        bgnd_color_flickering |= (bgnd_color_r | (bgnd_color_flickering & 0xFF00FFFF));
+        bgnd_color_flickering |= (bgnd_color_g | (bgnd_color_flickering & 0xFFFF00FF));
+        bgnd_color_flickering |= (bgnd_color_b | (bgnd_color_flickering & 0xFFFFFF00));
+        if (bgnd && (bgnd_color_flickering != bgnd_color_applied))
+        {
+            SDL_SetTextureColorMod(bgnd,
+                    (bgnd_color_flickering & Rmask) >> 16,
+                    (bgnd_color_flickering & Gmask) >>  8,
+                    (bgnd_color_flickering & Bmask) >>  0
+                    );
+            SDL_SetTextureAlphaMod(bgnd, (bgnd_color_flickering & Amask) >> 24);
+            bgnd_color_applied = bgnd_color_flickering;
+        }
+        TraceEnd("background", "frame", t_bgnd, -1);
+        // Clear the player
+        /* FillRect(empty_space, NOTHING_COLOR, player_pixels); */
+        // Clear the old particle position calculations
+        u64 t_sim = TraceBegin();
+        u64 t_sim_metrics = SDL_GetPerformanceCounter(); // TraceBegin is 0 unless tracing
+        bool rewound = false;
+        ApplyCommands(&command_ring, screen_pixels_prev, momentum_prev, looks_prev, &me, &rewound);
+        if (rewound)
+        {
+            // Hold still on the rewound world: NEXT is PREV.
+            memcpy(screen_pixels_next, screen_pixels_prev, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32));
+            memcpy(momentum_next, momentum_prev, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(momentum_t));
+            memcpy(looks_next, looks_prev, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(look_t));
+        }
+        else
+        {
+            FillRect(empty_space, NOTHING_COLOR, screen_pixels_next);
+            FillLookRect(empty_space, LOOK(LOOK_NOTHING, 0), looks_next);
+            DrawBorder(screen_pixels_next, looks_next);
+            DrawParticles(screen_pixels_prev, screen_pixels_next, momentum_prev, momentum_next,
+                          looks_prev, looks_next);
+            HistoryRecord(screen_pixels_next, looks_next);
+        }
+        TraceEnd("simulate", "frame", t_sim, -1);
+        MetricsTick((double)(SDL_GetPerformanceCounter() - t_sim_metrics) / (double)SDL_GetPerformanceFrequency(),
+                    !rewound);
+
+        // ---HUD: counts in the title bar---
+        if (--hud_countdown <= 0)
+        {
+            hud_countdown = HUD_FRAMES;
+            char hud[256];
+            PopulationHud(hud, keys_title);
+            if (heatmap.on) sprintf(hud + strlen(hud), "  | reddest chunk %d ns", heatmap_max_ns);
+            SDL_SetWindowTitle(win, hud);
+        }
 
         // Draw me in front of everything else
         /* FillRect(me, OUT_OF_BOUNDS_COLOR, screen_pixels_next); */
         /* FillRect(me, NOTHING_COLOR, screen_pixels_next); */
         /* FillRect(me, me_color, player_pixels); */
+        PopulationRect(me, screen_pixels_next, -1);
         FillRect(me, me_color, screen_pixels_next);
+        FillLookRect(me, LOOK(LOOK_ME, 0), looks_next);
+        if (   (me.x != me_drawn.x) || (me.y != me_drawn.y)
+            || (me.w != me_drawn.w) || (me.h != me_drawn.h))
+        {
+            MarkDirtyRect(me_drawn);
+            MarkDirtyRect(me);
+            me_drawn = me;
+        }
+        CameraUpdate(&camera, me);
+        if (   (camera.x != camera_drawn.x) || (camera.y != camera_drawn.y)
+            || (camera.zoom != camera_drawn.zoom))
+        {
+            RedrawAll();
+            camera_drawn = camera;
+        }
 
         /** BUFFER COPY
          *
          *  \brief Load screen[] with screen_next[]
          *
          *  Shift NEXT screen buffer into PREV screen buffer.
-         *  (PREV screen buffer is rendered in SDL_UpdateTexture).
+         *  (PREV screen buffer is rendered in UploadScreen).
          */
         {
             u32 *tmp_pix = screen_pixels_prev;
@@ -1126,80 +6113,186 @@ int main(int argc, char **argv)
             momentum_t *tmp_mom = momentum_prev;
             momentum_prev = momentum_next;
             momentum_next = tmp_mom;
+            //
+            look_t *tmp_looks = looks_prev;
+            looks_prev = looks_next;
+            looks_next = tmp_looks;
         }
 
         // Alpha experimentation
-        SDL_UpdateTexture(
-                layer_green, // SDL_Texture *
-                NULL, // NULL updates entire texture
-                layer_green_pixels, // const void *pixels
-                SCREEN_WIDTH * sizeof(u32) // int pitch
-                );
-        SDL_UpdateTexture(
-                layer_red, // SDL_Texture *
-                NULL, // NULL updates entire texture
-                layer_red_pixels, // const void *pixels
-                SCREEN_WIDTH * sizeof(u32) // int pitch
-                );
+        // Every layer, for the CPU compositor and for capture.
+        compositor_t comp;
+        comp.base = BlendPixel(bgnd_color_flickering, 0xFF000000); // over RenderClear black
+        comp.layers[0] = green_layer.pixels;
+        comp.layers[1] = red_layer.pixels;
+        comp.layers[2] = view_pixels; // filled by the colour pass
+        comp.nlayers = 3;
+        comp.scratch = composite_pixels;
 
-        SDL_UpdateTexture(
-                screen,        // SDL_Texture *
-                NULL,          // const SDL_Rect * - NULL updates entire texture
-                screen_pixels_prev, // const void *pixels
-                SCREEN_WIDTH * sizeof(u32) // int pitch - n bytes in a row of pixel data
-                );
-        SDL_UpdateTexture(
-                bgnd,        // SDL_Texture *
-                NULL,          // const SDL_Rect * - NULL updates entire texture
-                bgnd_pixels, // const void *pixels
-                SCREEN_WIDTH * sizeof(u32) // int pitch - n bytes in a row of pixel data
-                );
+        if (lighting_on)
+        {
+            u64 t_light = TraceBegin();
+            int nlight_changed = LightUpdate(looks_prev);
+            TraceEnd("light", "render", t_light, nlight_changed);
+        }
+
+        u64 t_pyramid = TraceBegin();
+        int npyramid_chunks = PyramidUpdate(looks_prev);
+        TraceEnd("pyramid", "render", t_pyramid, npyramid_chunks);
+        if (show_minimap) MinimapDraw(minimap_pixels, &camera);
+        if (heatmap.on)
+        {
+            u64 t_heatmap = TraceBegin();
+            heatmap_max_ns = HeatmapDraw(green_layer.pixels, &camera);
+            green_layer.dirty = true;
+            TraceEnd("heatmap", "render", t_heatmap, heatmap_max_ns);
+        }
+
+        u64 t_upload = TraceBegin();
+        int ndirty_rects;
+        if (composite_on_cpu || present_to_surface)
+        {
+            // A change under the simulation changes every pixel.
+            if (green_layer.dirty || red_layer.dirty || (comp.base != composited_base))
+            {
+                RedrawAll();
+                green_layer.dirty = false;
+                red_layer.dirty = false;
+                composited_base = comp.base;
+            }
+            if (present_to_surface)
+            {
+                ndirty_rects = PresentToSurface(win, looks_prev, &camera, view_pixels, &comp,
+                                                show_minimap ? minimap_pixels : NULL);
+                if (ndirty_rects < 0)
+                {
+                    log_to_file("Cannot present to the window surface. Quit.\n");
+                    done = true;
+                }
+            }
+            else
+            {
+                ndirty_rects = UploadScreen(composite, looks_prev, &camera, view_pixels, &comp);
+            }
+        }
+        else
+        {
+            UploadLayer(&green_layer);
+            UploadLayer(&red_layer);
+
+            ndirty_rects = UploadScreen(screen, looks_prev, &camera, view_pixels, NULL);
+            UploadLayer(&bgnd_layer);
+        }
         /* SDL_UpdateTexture( */
         /*         player,        // SDL_Texture * */
         /*         NULL,          // const SDL_Rect * - NULL updates entire texture */
         /*         player_pixels, // const void *pixels */
         /*         SCREEN_WIDTH * sizeof(u32) // int pitch - n bytes in a row of pixel data */
         /*         ); */
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(
-                renderer, // SDL_Renderer *
-                bgnd,   // SDL_Texture *
-                NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE
-                NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET
-                );
+        TraceEnd("upload", "render", t_upload, ndirty_rects);
 
-        // Alpha experimentation
-        SDL_RenderCopy(
-                renderer, // SDL_Renderer *
-                layer_green, // SDL_Texture *
-                NULL, NULL
-                );
-        SDL_RenderCopy(
-                renderer, // SDL_Renderer *
-                layer_red, // SDL_Texture *
-                NULL, NULL
-                );
+        u64 t_capture = TraceBegin();
+        if (capture.on && !(composite_on_cpu || present_to_surface))
+        {
+            // The GPU path coloured straight into the texture.
+            ColorView(looks_prev, &camera, view_pixels);
+        }
+        CaptureFrame(&comp);
+        TraceEnd("capture", "frame", t_capture, -1);
 
-        /* SDL_RenderCopy( */
-        /*         renderer, // SDL_Renderer * */
-        /*         player,   // SDL_Texture * */
-        /*         NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE */
-        /*         NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET */
-        /*         ); */
-        SDL_RenderCopy(
-                renderer, // SDL_Renderer *
-                screen,   // SDL_Texture *
-                NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE
-                NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET
-                );
-        SDL_RenderPresent(renderer);
+        u64 t_copy = TraceBegin();
+        if (present_to_surface)
+        {
+            ; // PresentToSurface already put it in the window
+        }
+        else if (composite_on_cpu)
+        {
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(renderer, composite, NULL, NULL);
+        }
+        else
+        {
+            SDL_RenderClear(renderer);
+            SDL_RenderCopy(
+                    renderer, // SDL_Renderer *
+                    bgnd,   // SDL_Texture *
+                    NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE
+                    NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET
+                    );
+
+            // Alpha experimentation
+            SDL_RenderCopy(
+                    renderer, // SDL_Renderer *
+                    layer_green, // SDL_Texture *
+                    NULL, NULL
+                    );
+            SDL_RenderCopy(
+                    renderer, // SDL_Renderer *
+                    layer_red, // SDL_Texture *
+                    NULL, NULL
+                    );
+
+            /* SDL_RenderCopy( */
+            /*         renderer, // SDL_Renderer * */
+            /*         player,   // SDL_Texture * */
+            /*         NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE */
+            /*         NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET */
+            /*         ); */
+            SDL_RenderCopy(
+                    renderer, // SDL_Renderer *
+                    screen,   // SDL_Texture *
+                    NULL, // const SDL_Rect * - SRC rect, NULL for entire TEXTURE
+                    NULL  // const SDL_Rect * - DEST rect, NULL for entire RENDERING TARGET
+                    );
+        }
+        if (show_minimap && renderer)
+        {
+            SDL_UpdateTexture(minimap, NULL, minimap_pixels, VIEW_WIDTH * sizeof(u32));
+            // Textures stretch to fit the window: so does the minimap.
+            int out_w, out_h;
+            SDL_GetRendererOutputSize(renderer, &out_w, &out_h);
+            SDL_Rect dst = {
+                minimap_rect.x * out_w / VIEW_WIDTH,
+                minimap_rect.y * out_h / VIEW_HEIGHT,
+                minimap_rect.w * out_w / VIEW_WIDTH,
+                minimap_rect.h * out_h / VIEW_HEIGHT
+            };
+            SDL_RenderCopy(renderer, minimap, NULL, &dst);
+        }
+        TraceEnd("render copy", "render", t_copy, -1);
+        u64 t_present = TraceBegin();
+        if (renderer) SDL_RenderPresent(renderer);
+        TraceEnd("SDL_RenderPresent", "render", t_present, -1);
+
+        u64 t_delay = TraceBegin();
+        PacerWait(&pacer); // sets frame rate
+        TraceEnd("pacer wait", "frame", t_delay, -1);
+
+        TraceEnd("frame", "frame", t_frame, -1);
+        TraceFrameDone();
+    }
 
-        SDL_Delay(15); // sets frame rate
+    CaptureShutdown();
+    MetricsShutdown();
+    JobsShutdown();
+    HistoryLog();
+    PopulationLog();
+    if (SDL_AtomicGet(&command_ring.ndropped) > 0)
+    {
+        sprintf(log_msg, "Commands: dropped %d (ring full)\n", SDL_AtomicGet(&command_ring.ndropped));
+        log_to_file(log_msg);
+    }
 
+    // Quit in the middle of a recording? Keep what we have.
+    if (SDL_AtomicGet(&trace_on))
+    {
+        SDL_AtomicSet(&trace_on, 0);
+        TraceWrite("trace.json");
     }
 
-    SDL_DestroyRenderer(renderer);
+    if (renderer) SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(win);
+    ArenaFree(&arena);
     SDL_Quit();
 
     return 0;